@@ -0,0 +1,308 @@
+#include <signal.h>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Metrics.h"
+#include "Socket.h"
+#include "Utility.h"
+
+
+// Drives concurrent sessions against a running server over loopback. Each session
+// logs in, repeats PASV+LIST, PASV+STOR and PASV+RETR of its own file for a number
+// of rounds, quits and starts over until the time is up. The results go to stdout
+// as JSON so runs can be compared by a script, progress goes to stderr.
+struct BenchConfig {
+    std::string host;
+    uint16_t    port;
+    std::string username;
+    std::string password;
+    unsigned    sessions = 8;
+    unsigned    seconds  = 10;
+    unsigned    rounds   = 10;
+    std::size_t fileSize = 1024 * 1024;
+};
+
+
+enum Step {
+    CONNECT = 0,
+    USER,
+    PASS,
+    TYPE,
+    PASV,
+    LIST,
+    STOR,
+    RETR,
+    QUIT,
+    STEP_MAX,
+};
+
+static const char *STEP_NAMES[STEP_MAX] = { "CONNECT", "USER", "PASS", "TYPE", "PASV", "LIST", "STOR", "RETR", "QUIT" };
+
+
+/************************************************************
+ * LoadGenerator class definition
+ ************************************************************/
+class LoadGenerator {
+public:
+    LoadGenerator(const BenchConfig &config)
+        : _config{config}
+    {
+        for (int step = 0; step < STEP_MAX; ++step) {
+            _stepIds[step] = _metrics.commandId(STEP_NAMES[step]);
+            _counts[step]  = 0;
+        }
+
+        _errors        = 0;
+        _bytesSent     = 0;
+        _bytesReceived = 0;
+    }
+
+
+    void run() {
+        auto start = std::chrono::steady_clock::now();
+        _deadline  = start + std::chrono::seconds(_config.seconds);
+
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < _config.sessions; ++i)
+            threads.emplace_back(&LoadGenerator::runSessions, this, i);
+
+        for (auto &thread : threads)
+            thread.join();
+
+        _elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+
+    void report(std::ostream &out) const {
+        uint64_t commands = 0;
+        for (int step = USER; step < STEP_MAX; ++step)
+            commands += _counts[step];
+
+        char rates[256];
+        std::snprintf(rates, sizeof(rates),
+                      "  \"connections_per_s\": %.1f,\n  \"commands_per_s\": %.1f,\n  \"transfer_gb_per_s\": %.3f,\n",
+                      _counts[CONNECT] / _elapsed, commands / _elapsed,
+                      (_bytesSent + _bytesReceived) / _elapsed / 1e9);
+
+        out << "{\n";
+        out << "  \"sessions\": " << _config.sessions << ",\n";
+        out << "  \"file_size\": " << _config.fileSize << ",\n";
+        out << "  \"seconds\": " << _elapsed << ",\n";
+        out << "  \"connections\": " << _counts[CONNECT] << ",\n";
+        out << "  \"commands\": " << commands << ",\n";
+        out << "  \"bytes_sent\": " << _bytesSent << ",\n";
+        out << "  \"bytes_received\": " << _bytesReceived << ",\n";
+        out << "  \"errors\": " << _errors << ",\n";
+        out << rates;
+        out << "  \"latency_us\": {\n";
+        for (int step = 0; step < STEP_MAX; ++step) {
+            int id = _stepIds[step];
+            out << "    \"" << STEP_NAMES[step] << "\": { \"count\": " << _counts[step]
+                << ", \"p50\": " << _metrics.commandPercentile(id, 50).count()
+                << ", \"p90\": " << _metrics.commandPercentile(id, 90).count()
+                << ", \"p99\": " << _metrics.commandPercentile(id, 99).count()
+                << ", \"max\": " << _metrics.commandPercentile(id, 100).count()
+                << " }" << (step == STEP_MAX-1 ? "\n" : ",\n");
+        }
+        out << "  }\n";
+        out << "}\n";
+    }
+
+private:
+    // reads a reply, skipping the lines of a multiline one, and returns its code
+    static int readReply(Socket &ctrlSock) {
+        char line[2048];
+        while (true) {
+            auto rn = ctrlSock.readline(line, sizeof(line));
+            if (rn == 0)
+                throw SocketException();
+
+            if (rn >= 4 && line[3] == ' ' && isdigit(line[0]) && isdigit(line[1]) && isdigit(line[2]))
+                return std::stoi(std::string(line, 3));
+        }
+    }
+
+
+    static void writeCommand(Socket &ctrlSock, const std::string &command) {
+        std::string line = command + "\r\n";
+        ctrlSock.write(reinterpret_cast<const Byte *>(line.data()), line.size());
+    }
+
+
+    void expect(Socket &ctrlSock, int code) {
+        if (readReply(ctrlSock) != code)
+            throw std::runtime_error("unexpected reply");
+    }
+
+
+    void record(Step step, std::chrono::steady_clock::time_point start) {
+        _metrics.recordCommand(_stepIds[step], std::chrono::steady_clock::now() - start);
+        ++_counts[step];
+    }
+
+
+    // sends a command expecting a single reply
+    void command(Socket &ctrlSock, Step step, const std::string &line, int code) {
+        auto start = std::chrono::steady_clock::now();
+        writeCommand(ctrlSock, line);
+        expect(ctrlSock, code);
+        record(step, start);
+    }
+
+
+    Socket openPassive(Socket &ctrlSock) {
+        auto start = std::chrono::steady_clock::now();
+        writeCommand(ctrlSock, "PASV");
+        char line[256];
+        auto rn = ctrlSock.readline(line, sizeof(line));
+        std::string reply(line, rn);
+        auto open = reply.find('(');
+        auto fields = open == std::string::npos ? std::vector<std::string>()
+                                                : splitString(reply.substr(open + 1, reply.find(')') - open - 1), ",");
+        if (reply.compare(0, 4, "227 ") != 0 || fields.size() != 6)
+            throw std::runtime_error("unexpected reply");
+
+        uint16_t port = static_cast<uint16_t>(std::stoi(fields[4]) * 256 + std::stoi(fields[5]));
+        Socket dataSock = Socket::connect(_config.host, port);
+        record(PASV, start);
+        return dataSock;
+    }
+
+
+    std::size_t readAll(Socket &dataSock, std::vector<Byte> &buffer) {
+        std::size_t total = 0;
+        while (true) {
+            auto rn = dataSock.read(buffer.data(), buffer.size());
+            total += rn;
+            if (rn < buffer.size())
+                return total;
+        }
+    }
+
+
+    void runSession(unsigned index, std::vector<Byte> &upload, std::vector<Byte> &buffer) {
+        auto start = std::chrono::steady_clock::now();
+        Socket ctrlSock = Socket::connect(_config.host, _config.port);
+        expect(ctrlSock, 220);
+        record(CONNECT, start);
+
+        command(ctrlSock, USER, "USER " + _config.username, 331);
+        command(ctrlSock, PASS, "PASS " + _config.password, 230);
+        command(ctrlSock, TYPE, "TYPE I", 200);
+
+        std::string file = "bench-" + std::to_string(index) + ".bin";
+        for (unsigned round = 0; round < _config.rounds && std::chrono::steady_clock::now() < _deadline; ++round) {
+            Socket dataSock = openPassive(ctrlSock);
+            start = std::chrono::steady_clock::now();
+            writeCommand(ctrlSock, "LIST");
+            expect(ctrlSock, 150);
+            _bytesReceived += readAll(dataSock, buffer);
+            expect(ctrlSock, 226);
+            record(LIST, start);
+
+            dataSock = openPassive(ctrlSock);
+            start = std::chrono::steady_clock::now();
+            writeCommand(ctrlSock, "STOR " + file);
+            expect(ctrlSock, 150);
+            dataSock.write(upload.data(), upload.size());
+            dataSock = Socket();
+            expect(ctrlSock, 226);
+            _bytesSent += upload.size();
+            record(STOR, start);
+
+            dataSock = openPassive(ctrlSock);
+            start = std::chrono::steady_clock::now();
+            writeCommand(ctrlSock, "RETR " + file);
+            expect(ctrlSock, 150);
+            _bytesReceived += readAll(dataSock, buffer);
+            expect(ctrlSock, 226);
+            record(RETR, start);
+        }
+
+        command(ctrlSock, QUIT, "QUIT", 221);
+    }
+
+
+    void runSessions(unsigned index) {
+        std::vector<Byte> upload(_config.fileSize, 'x');
+        std::vector<Byte> buffer(256 * 1024);
+        while (std::chrono::steady_clock::now() < _deadline) {
+            try {
+                runSession(index, upload, buffer);
+            } catch (const std::exception &e) {
+                if (++_errors <= 10)
+                    std::cerr << "session " << index << ": " << e.what() << "\n";
+            }
+        }
+    }
+
+
+    BenchConfig _config;
+    Metrics _metrics;
+    int _stepIds[STEP_MAX];
+    std::atomic<uint64_t> _counts[STEP_MAX];
+    std::atomic<uint64_t> _errors;
+    std::atomic<uint64_t> _bytesSent;
+    std::atomic<uint64_t> _bytesReceived;
+    std::chrono::steady_clock::time_point _deadline;
+    double _elapsed;
+};
+
+
+void displayUsage() {
+    std::cout << "Usage: bench_ftp_server [host] [port number] [username] [password] [options]\n";
+    std::cout << "[options            ]: OPTIONAL. Any of the following\n";
+    std::cout << "    --sessions N  : sessions running at once. Default is 8\n";
+    std::cout << "    --seconds N   : how long to run. Default is 10\n";
+    std::cout << "    --rounds N    : LIST, STOR and RETR rounds per login. Default is 10\n";
+    std::cout << "    --size BYTES  : size of the file each session uploads and downloads. Default is 1048576\n";
+}
+
+
+bool parseOption(const std::string &option, const std::string &value, BenchConfig &config) {
+    if (option == "--sessions")
+        return toUnsignedInt<unsigned>(value, config.sessions) == 0 && config.sessions > 0;
+    else if (option == "--seconds")
+        return toUnsignedInt<unsigned>(value, config.seconds) == 0;
+    else if (option == "--rounds")
+        return toUnsignedInt<unsigned>(value, config.rounds) == 0;
+    else if (option == "--size")
+        return toUnsignedInt<std::size_t>(value, config.fileSize) == 0;
+
+    return false;
+}
+
+
+int main(int argc, const char **argv) {
+    BenchConfig config;
+    if (argc < 5 || argc % 2 == 0 || toUnsignedInt<uint16_t>(argv[2], config.port) != 0) {
+        displayUsage();
+        return 1;
+    }
+
+    config.host     = argv[1];
+    config.username = argv[3];
+    config.password = argv[4];
+    for (int i = 5; i < argc; i += 2) {
+        if (!parseOption(argv[i], argv[i+1], config)) {
+            std::cout << "Invalid option " << argv[i] << " " << argv[i+1] << "\n";
+            displayUsage();
+            return 1;
+        }
+    }
+
+    // a server that went away must show up as errors, not end the run
+    signal(SIGPIPE, SIG_IGN);
+
+    std::cerr << "Running " << config.sessions << " sessions for " << config.seconds << " seconds\n";
+    LoadGenerator generator(config);
+    generator.run();
+    generator.report(std::cout);
+    return 0;
+}
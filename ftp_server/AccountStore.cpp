@@ -0,0 +1,104 @@
+#include <sys/inotify.h>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include "AccountStore.h"
+#include "FileWatcher.h"
+#include "Utility.h"
+
+
+/************************************************************
+ * AccountStore class definition
+ ************************************************************/
+struct AccountStore::Impl {
+    using Index = std::unordered_map<std::string, Account>;
+
+    std::string accountsFile;
+
+    // only accessed with std::atomic_load and std::atomic_store
+    std::shared_ptr<const Index> index;
+};
+
+
+AccountStore::AccountStore(std::string accountsFile) {
+    _impl = std::make_unique<Impl>();
+    _impl->accountsFile = std::move(accountsFile);
+}
+
+
+AccountStore::~AccountStore()
+{}
+
+
+bool AccountStore::reload() {
+    // an index once loaded stays until a reload finds accounts to replace it
+    std::ifstream accounts(_impl->accountsFile);
+    if (!accounts)
+        return false;
+
+    auto index = std::make_shared<Impl::Index>();
+    std::string line;
+    while (std::getline(accounts, line)) {
+        std::istringstream fields(line);
+        std::string user, pass, homeDir, rate;
+        if (!(fields >> user >> pass >> homeDir))
+            continue;
+
+        // a missing or malformed rate limit leaves the user unlimited
+        uint64_t rateLimit = 0;
+        if (fields >> rate && toUnsignedInt(rate, rateLimit) != 0)
+            rateLimit = 0;
+
+        // first entry of a user wins, like the scan of the file used to
+        index->insert({user, Account{pass, normalizePath(homeDir), rateLimit}});
+    }
+
+    // a file caught empty or half written by an editor would lock every user out
+    if (index->empty() && isLoaded())
+        return true;
+
+    std::atomic_store(&_impl->index, std::shared_ptr<const Impl::Index>(std::move(index)));
+    return true;
+}
+
+
+bool AccountStore::watch(FileWatcher &watcher) {
+    // watch the directory rather than the file, so files replaced by rename are seen too
+    std::string dir = ".";
+    std::string name = _impl->accountsFile;
+    auto pos = name.find_last_of('/');
+    if (pos != std::string::npos) {
+        dir  = pos == 0 ? "/" : name.substr(0, pos);
+        name = name.substr(pos+1);
+    }
+
+    // only a file written to the end or renamed into place is complete. The directory
+    // watch may be shared with others asking for more events, so the mask is checked too
+    static const uint32_t MASK = IN_CLOSE_WRITE | IN_MOVED_TO;
+    int watchId = watcher.addWatch(dir, MASK, [this, name](uint32_t mask, const std::string &changed) {
+        if ((mask & MASK) && changed == name)
+            reload();
+    });
+
+    return watchId != -1;
+}
+
+
+bool AccountStore::isLoaded() const {
+    return std::atomic_load(&_impl->index) != nullptr;
+}
+
+
+bool AccountStore::find(const std::string &username, Account &account) const {
+    auto index = std::atomic_load(&_impl->index);
+    if (!index)
+        return false;
+
+    auto entry = index->find(username);
+    if (entry == index->end())
+        return false;
+
+    account = entry->second;
+    return true;
+}
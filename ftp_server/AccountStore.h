@@ -0,0 +1,53 @@
+#ifndef ACCOUNTSTORE_H
+#define ACCOUNTSTORE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+
+class FileWatcher;
+
+
+struct Account {
+    std::string password;
+    std::string nativeHomeDir;
+
+    // bytes per second shared by all sessions of the user, 0 means unlimited
+    uint64_t    rateLimit;
+};
+
+
+// In memory index of the accounts file shared by every session. Each line of
+// the file holds a user, a password, a home directory and optionally a rate
+// limit in bytes per second. The file is parsed once into a hash table, and
+// reloaded in the background whenever it changes. Readers always see a
+// complete index: a reload builds a new table and publishes it with a single
+// pointer swap. A reload that finds no accounts keeps the previous index.
+class AccountStore {
+public:
+    AccountStore(std::string accountsFile);
+
+    AccountStore(const AccountStore &) = delete;
+
+    AccountStore &operator=(const AccountStore &) = delete;
+
+    ~AccountStore();
+
+    // returns false if the accounts file cannot be read
+    bool reload();
+
+    bool watch(FileWatcher &watcher);
+
+    // returns false if the accounts file is not loaded
+    bool isLoaded() const;
+
+    bool find(const std::string &username, Account &account) const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+
+#endif // ACCOUNTSTORE_H
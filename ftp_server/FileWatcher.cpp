@@ -0,0 +1,144 @@
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/poll.h>
+#include <unistd.h>
+#include <climits>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "FileWatcher.h"
+
+
+/************************************************************
+ * FileWatcher class definition
+ ************************************************************/
+struct FileWatcher::Impl {
+    void run() {
+        alignas(inotify_event) char buf[16 * (sizeof(inotify_event) + NAME_MAX + 1)];
+        pollfd fds[2];
+        fds[0].fd = inotifyfd;
+        fds[0].events = POLLIN;
+        fds[1].fd = stopfd;
+        fds[1].events = POLLIN;
+
+        while (true) {
+            if (poll(fds, 2, -1) == -1)
+                continue;
+
+            if (fds[1].revents & POLLIN)
+                return;
+
+            auto rn = read(inotifyfd, buf, sizeof(buf));
+            if (rn <= 0)
+                continue;
+
+            for (char *p = buf; p < buf + rn; ) {
+                auto event = reinterpret_cast<const inotify_event *>(p);
+                p += sizeof(inotify_event) + event->len;
+
+                // copy the callbacks so they may remove their own watch
+                std::vector<Callback> callbacks;
+                {
+                    std::lock_guard<std::mutex> guard(mutex);
+                    auto watch = watches.find(event->wd);
+                    if (watch == watches.end())
+                        continue;
+
+                    for (const auto &callback : watch->second)
+                        callbacks.push_back(callback.second);
+
+                    // kernel dropped the watch, e.g. the path was deleted
+                    if (event->mask & IN_IGNORED) {
+                        for (const auto &callback : watch->second)
+                            watchIds.erase(callback.first);
+
+                        watches.erase(watch);
+                    }
+                }
+
+                std::string name = event->len > 0 ? std::string(event->name) : std::string();
+                for (const auto &callback : callbacks)
+                    callback(event->mask, name);
+            }
+        }
+    }
+
+
+    int inotifyfd;
+    int stopfd;
+    int nextWatchId;
+    std::mutex mutex;
+
+    // inotify descriptor to the callbacks sharing it by watch id, and back
+    std::map<int, std::map<int, Callback>> watches;
+    std::map<int, int> watchIds;
+    std::thread thread;
+};
+
+
+FileWatcher::FileWatcher() {
+    _impl = std::make_unique<Impl>();
+    _impl->inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    _impl->stopfd    = eventfd(0, EFD_CLOEXEC);
+    _impl->nextWatchId = 0;
+    if (_impl->inotifyfd != -1 && _impl->stopfd != -1)
+        _impl->thread = std::thread(&Impl::run, _impl.get());
+}
+
+
+FileWatcher::~FileWatcher() {
+    if (_impl->thread.joinable()) {
+        uint64_t one = 1;
+        auto wn = write(_impl->stopfd, &one, sizeof(one));
+        (void)wn;
+        _impl->thread.join();
+    }
+
+    if (_impl->inotifyfd != -1)
+        close(_impl->inotifyfd);
+
+    if (_impl->stopfd != -1)
+        close(_impl->stopfd);
+}
+
+
+bool FileWatcher::isValid() const {
+    return _impl->thread.joinable();
+}
+
+
+int FileWatcher::addWatch(const std::string &path, uint32_t mask, Callback callback) {
+    if (!isValid())
+        return -1;
+
+    std::lock_guard<std::mutex> guard(_impl->mutex);
+
+    // the path may already be watched, so add to its mask instead of replacing it
+    int wd = inotify_add_watch(_impl->inotifyfd, path.c_str(), mask | IN_MASK_ADD);
+    if (wd == -1)
+        return -1;
+
+    int watchId = _impl->nextWatchId++;
+    _impl->watches[wd][watchId] = std::move(callback);
+    _impl->watchIds[watchId] = wd;
+    return watchId;
+}
+
+
+void FileWatcher::removeWatch(int watchId) {
+    std::lock_guard<std::mutex> guard(_impl->mutex);
+    auto id = _impl->watchIds.find(watchId);
+    if (id == _impl->watchIds.end())
+        return;
+
+    int wd = id->second;
+    _impl->watchIds.erase(id);
+
+    auto &callbacks = _impl->watches[wd];
+    callbacks.erase(watchId);
+    if (callbacks.empty()) {
+        _impl->watches.erase(wd);
+        inotify_rm_watch(_impl->inotifyfd, wd);
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef FILEWATCHER_H
+#define FILEWATCHER_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+
+// Watches files and directories with inotify from a background thread.
+// Callbacks run on that thread, they get the event mask and, for events
+// inside a watched directory, the name of the entry. Several watches may
+// share a path, each of them then sees the events of all of their masks.
+class FileWatcher {
+public:
+    using Callback = std::function<void(uint32_t mask, const std::string &name)>;
+
+    FileWatcher();
+
+    FileWatcher(const FileWatcher &) = delete;
+
+    FileWatcher &operator=(const FileWatcher &) = delete;
+
+    ~FileWatcher();
+
+    bool isValid() const;
+
+    // returns the watch id, or -1 if the path cannot be watched
+    int addWatch(const std::string &path, uint32_t mask, Callback callback);
+
+    void removeWatch(int watchId);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+
+#endif // FILEWATCHER_H
@@ -0,0 +1,598 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <unistd.h>
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "FtpServer.h"
+#include "FtpSession.h"
+#include "AccountStore.h"
+#include "FileWatcher.h"
+#include "ListingCache.h"
+#include "Logger.h"
+#include "Metrics.h"
+#include "PassivePortAllocator.h"
+#include "Socket.h"
+#include "SyncBatcher.h"
+#include "TokenBucket.h"
+#include "WorkerPool.h"
+
+static const int QUEUE_MAX = 100;
+static const int EVENT_MAX = 256;
+
+
+// counts the connection in, or turns the client away instead of queuing it when
+// the server is full
+static bool admitSession(Socket &connectSock, std::atomic<std::size_t> &activeSessions, std::size_t maxSessions) {
+    if (++activeSessions <= maxSessions)
+        return true;
+
+    --activeSessions;
+    std::string reply = std::to_string(SERVICE_UNAVAILABLE) + " Too many users, try again later\r\n";
+    connectSock.write(reinterpret_cast<const Byte *>(reply.data()), reply.size());
+    return false;
+}
+
+
+/************************************************************
+ * EventLoop class definition
+ ************************************************************/
+class EventLoop {
+public:
+    EventLoop(FtpServer &server, WorkerPool &workers, std::atomic<std::size_t> &activeSessions)
+        : _server{server}
+        , _workers{workers}
+        , _activeSessions{activeSessions}
+    {
+        _epollfd = epoll_create1(EPOLL_CLOEXEC);
+        _wakefd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (_epollfd == -1 || _wakefd == -1)
+            throw SocketException();
+
+        epoll_event event;
+        event.events  = EPOLLIN;
+        event.data.fd = _wakefd;
+        if (epoll_ctl(_epollfd, EPOLL_CTL_ADD, _wakefd, &event) == -1)
+            throw SocketException();
+    }
+
+
+    EventLoop(const EventLoop &) = delete;
+
+
+    EventLoop &operator=(const EventLoop &) = delete;
+
+
+    ~EventLoop() {
+        close(_wakefd);
+        close(_epollfd);
+    }
+
+
+    // can be called from any thread
+    void addSession(Socket ctrlSock) {
+        std::lock_guard<std::mutex> guard(_queueMutex);
+        _newSessions.push_back(std::move(ctrlSock));
+        wake();
+    }
+
+
+    // accepts on the listener itself, must be called before run
+    void addListener(Socket listenSock) {
+        listenSock.setNonBlocking(true);
+
+        epoll_event event;
+        event.events  = EPOLLIN;
+        event.data.fd = listenSock.nativeHandle();
+        if (epoll_ctl(_epollfd, EPOLL_CTL_ADD, listenSock.nativeHandle(), &event) == -1)
+            throw SocketException();
+
+        _listenSock = std::move(listenSock);
+    }
+
+
+    // can be called from any thread
+    void completeTransfer(int fd) {
+        std::lock_guard<std::mutex> guard(_queueMutex);
+        _completedTransfers.push_back(fd);
+        wake();
+    }
+
+
+    void run() {
+        epoll_event events[EVENT_MAX];
+        while (true) {
+            int n = epoll_wait(_epollfd, events, EVENT_MAX, nextTimeout());
+            for (int i = 0; i < n; ++i) {
+                if (events[i].data.fd == _wakefd)
+                    drainQueues();
+                else if (events[i].data.fd == _listenSock.nativeHandle())
+                    acceptSessions();
+                else {
+                    if (events[i].events & EPOLLOUT)
+                        flushReplies(events[i].data.fd);
+
+                    if (events[i].events & ~EPOLLOUT)
+                        service(events[i].data.fd);
+                }
+            }
+
+            expireIdleSessions();
+        }
+    }
+
+private:
+    struct Session {
+        std::unique_ptr<FtpServerPI> PI;
+        std::list<int>::iterator idlePos;
+        std::chrono::steady_clock::time_point lastActive;
+        bool busy;
+        bool watchingOutput;
+    };
+
+
+    void wake() {
+        uint64_t one = 1;
+        auto wn = ::write(_wakefd, &one, sizeof(one));
+        (void)wn;
+    }
+
+
+    void drainQueues() {
+        uint64_t count;
+        while (::read(_wakefd, &count, sizeof(count)) > 0)
+            continue;
+
+        std::vector<Socket> newSessions;
+        std::vector<int> completedTransfers;
+        {
+            std::lock_guard<std::mutex> guard(_queueMutex);
+            newSessions.swap(_newSessions);
+            completedTransfers.swap(_completedTransfers);
+        }
+
+        for (auto &ctrlSock : newSessions)
+            openSession(std::move(ctrlSock));
+
+        for (int fd : completedTransfers) {
+            auto session = _sessions.find(fd);
+            if (session == _sessions.end())
+                continue;
+
+            session->second.PI->finishPendingTransfer();
+            session->second.busy = false;
+            session->second.lastActive = std::chrono::steady_clock::now();
+            session->second.idlePos = _idle.insert(_idle.end(), fd);
+            service(fd);
+        }
+    }
+
+
+    void acceptSessions() {
+        // a burst of connections is taken in one go, up to what fits in the loop's turn
+        for (int i = 0; i < EVENT_MAX; ++i) {
+            try {
+                Socket connectSock = Socket::accept(_listenSock);
+                if (!connectSock.isValid())
+                    return;
+
+                if (admitSession(connectSock, _activeSessions, _server.config().maxSessions))
+                    openSession(std::move(connectSock));
+            } catch (const SocketException &e) {
+                std::cout << e.what() << "\n";
+                return;
+            }
+        }
+    }
+
+
+    void openSession(Socket ctrlSock) {
+        int fd = ctrlSock.nativeHandle();
+        try {
+            ctrlSock.setNonBlocking(true);
+
+            // every reply is a single write, Nagle would only hold the 226 after a 150
+            // back until the client acks, which it delays by up to 40ms
+            ctrlSock.setNoDelay(true);
+
+            epoll_event event;
+            event.events  = EPOLLIN | EPOLLRDHUP | EPOLLET;
+            event.data.fd = fd;
+            if (epoll_ctl(_epollfd, EPOLL_CTL_ADD, fd, &event) == -1)
+                throw SocketException();
+        } catch (const SocketException &e) {
+            std::cout << e.what() << "\n";
+            --_activeSessions;
+            return;
+        }
+
+        Session &session = _sessions[fd];
+        session.PI = std::make_unique<FtpServerPI>(std::move(ctrlSock), _server);
+        session.idlePos = _idle.insert(_idle.end(), fd);
+        session.busy = false;
+        session.watchingOutput = false;
+
+        try {
+            session.PI->start();
+        } catch (const std::exception &) {
+            closeSession(fd);
+            return;
+        }
+
+        // the client may have sent something before the socket was registered
+        service(fd);
+    }
+
+
+    void service(int fd) {
+        auto it = _sessions.find(fd);
+        if (it == _sessions.end())
+            return;
+
+        // the session stays open until its transfer completes, only ABOR and STAT are
+        // answered meanwhile
+        Session &session = it->second;
+        if (session.busy) {
+            try {
+                session.PI->onReadableDuringTransfer();
+            } catch (const std::exception &) {
+                session.PI->abortTransfer();
+            }
+
+            watchOutput(fd, session);
+            return;
+        }
+
+        try {
+            session.PI->onReadable();
+        } catch (const std::exception &) {
+            closeSession(fd);
+            return;
+        }
+
+        if (session.PI->closed()) {
+            closeSession(fd);
+            return;
+        }
+
+        if (session.PI->hasPendingTransfer()) {
+            session.busy = true;
+            _idle.erase(session.idlePos);
+            session.idlePos = _idle.end();
+
+            FtpServerPI *PI = session.PI.get();
+            _workers.submit([this, PI, fd]() {
+                PI->runPendingTransfer();
+                completeTransfer(fd);
+            });
+            watchOutput(fd, session);
+            return;
+        }
+
+        session.lastActive = std::chrono::steady_clock::now();
+        _idle.splice(_idle.end(), _idle, session.idlePos);
+        watchOutput(fd, session);
+    }
+
+
+    void flushReplies(int fd) {
+        auto it = _sessions.find(fd);
+        if (it == _sessions.end())
+            return;
+
+        // a session in a transfer is closed by the transfer, not under it
+        Session &session = it->second;
+        try {
+            session.PI->flushCtrl();
+        } catch (const std::exception &) {
+            if (session.busy)
+                session.PI->abortTransfer();
+            else
+                closeSession(fd);
+
+            return;
+        }
+
+        watchOutput(fd, session);
+    }
+
+
+    // the session only hears about the socket turning writable while it has
+    // replies waiting, otherwise every ACK would wake the loop
+    void watchOutput(int fd, Session &session) {
+        bool pending = session.PI->hasPendingOutput();
+        if (pending == session.watchingOutput)
+            return;
+
+        uint32_t events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        if (pending)
+            events |= EPOLLOUT;
+
+        epoll_event event;
+        event.events  = events;
+        event.data.fd = fd;
+        if (epoll_ctl(_epollfd, EPOLL_CTL_MOD, fd, &event) == 0)
+            session.watchingOutput = pending;
+    }
+
+
+    void closeSession(int fd) {
+        auto it = _sessions.find(fd);
+        if (it == _sessions.end())
+            return;
+
+        if (it->second.idlePos != _idle.end())
+            _idle.erase(it->second.idlePos);
+
+        epoll_ctl(_epollfd, EPOLL_CTL_DEL, fd, nullptr);
+        _sessions.erase(it);
+        --_activeSessions;
+    }
+
+
+    int nextTimeout() const {
+        if (_idle.empty())
+            return -1;
+
+        auto deadline = _sessions.at(_idle.front()).lastActive + std::chrono::milliseconds(FtpServerPI::TIME_OUT);
+        auto remain = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        return remain.count() < 0 ? 0 : static_cast<int>(remain.count()) + 1;
+    }
+
+
+    void expireIdleSessions() {
+        // idle list is ordered by last activity, so only its front can expire
+        auto now = std::chrono::steady_clock::now();
+        while (!_idle.empty()) {
+            int fd = _idle.front();
+            Session &session = _sessions.at(fd);
+            if (now - session.lastActive < std::chrono::milliseconds(FtpServerPI::TIME_OUT))
+                break;
+
+            try {
+                session.PI->writeCtrl(SERVICE_UNAVAILABLE, "Time out");
+            } catch (const std::exception &) {}
+
+            closeSession(fd);
+        }
+    }
+
+
+    FtpServer &_server;
+    WorkerPool &_workers;
+    std::atomic<std::size_t> &_activeSessions;
+    int _epollfd;
+    int _wakefd;
+    Socket _listenSock;
+    std::mutex _queueMutex;
+    std::vector<Socket> _newSessions;
+    std::vector<int> _completedTransfers;
+    std::unordered_map<int, Session> _sessions;
+    std::list<int> _idle;
+};
+
+
+/************************************************************
+ * FtpServer class definition
+ ************************************************************/
+struct FtpServer::Impl {
+    FtpServerConfig config;
+    std::unique_ptr<PassivePortAllocator> portAllocator;
+    std::unique_ptr<AccountStore> accounts;
+    std::unique_ptr<FileWatcher> watcher;
+    std::unique_ptr<ListingCache> listingCache;
+    std::unique_ptr<Metrics> metrics;
+    std::unique_ptr<Logger> logger;
+    std::unique_ptr<SyncBatcher> syncBatcher;
+    std::unique_ptr<TokenBucket> globalRateLimit;
+
+    // buckets live as long as a session of their user holds them
+    std::mutex userRateLimitsMutex;
+    std::unordered_map<std::string, std::weak_ptr<TokenBucket>> userRateLimits;
+    std::unique_ptr<WorkerPool> workers;
+    bool workersFollowLimits;
+    std::unique_ptr<WorkerPool> ioWorkers;
+    std::atomic<std::size_t> activeSessions;
+    std::vector<std::unique_ptr<EventLoop>> loops;
+};
+
+
+FtpServer::FtpServer(FtpServerConfig config) {
+    _impl = std::make_unique<Impl>();
+    _impl->config = std::move(config);
+    if (_impl->config.eventLoops == 0)
+        _impl->config.eventLoops = std::max(1u, std::thread::hardware_concurrency());
+
+    // a rate limited transfer holds its worker while it waits, so with a limit every
+    // session gets one and the limit shares bandwidth instead of queueing transfers.
+    // Limits of users in the accounts file grow the pool once such a user logs in
+    _impl->workersFollowLimits = _impl->config.workerThreads == 0;
+    if (_impl->workersFollowLimits && (_impl->config.globalRateLimit > 0 || _impl->config.sessionRateLimit > 0))
+        _impl->config.workerThreads = static_cast<unsigned>(_impl->config.maxSessions);
+
+    if (_impl->config.workerThreads == 0)
+        _impl->config.workerThreads = 4 * std::max(1u, std::thread::hardware_concurrency());
+
+    if (_impl->config.ioThreads == 0)
+        _impl->config.ioThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    _impl->activeSessions = 0;
+
+    _impl->portAllocator = std::make_unique<PassivePortAllocator>(_impl->config.passivePortMin,
+                                                                  _impl->config.passivePortMax,
+                                                                  _impl->config.eventLoops);
+
+    // accounts are loaded once and kept up to date as the file changes
+    _impl->accounts = std::make_unique<AccountStore>(_impl->config.accountsFile);
+    if (!_impl->accounts->reload())
+        std::cout << "Cannot open accounts file " << _impl->config.accountsFile << "\n";
+
+    _impl->watcher = std::make_unique<FileWatcher>();
+    if (!_impl->accounts->watch(*_impl->watcher))
+        std::cout << "Cannot watch accounts file " << _impl->config.accountsFile << " for changes\n";
+
+    _impl->listingCache = std::make_unique<ListingCache>(_impl->config.listingCacheSize, *_impl->watcher);
+
+    _impl->metrics = std::make_unique<Metrics>();
+
+    // commands are recorded under their position in the dispatch table
+    for (int id = 0; id < FtpCommand::count(); ++id)
+        _impl->metrics->commandId(FtpCommand::byId(id).name);
+
+    _impl->logger = std::make_unique<Logger>(_impl->config.logFile);
+
+    if (_impl->config.globalRateLimit > 0)
+        _impl->globalRateLimit = std::make_unique<TokenBucket>(_impl->config.globalRateLimit);
+
+    // sessions reach the disk workers through ioWorkers(), also outside of run()
+    _impl->ioWorkers = std::make_unique<WorkerPool>(_impl->config.ioThreads);
+
+    if (_impl->config.durability == BATCHED_SYNC)
+        _impl->syncBatcher = std::make_unique<SyncBatcher>(std::chrono::milliseconds(_impl->config.syncBatchMs));
+}
+
+
+FtpServer::~FtpServer()
+{}
+
+
+void FtpServer::run() {
+    // sendfile and splice have no MSG_NOSIGNAL, an aborted transfer must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!_impl->config.logFile.empty() && !_impl->logger->isOpen()) {
+        std::cout << "Cannot open file " << _impl->config.logFile << "\n";
+        return;
+    }
+
+    Socket listenSock;
+    try {
+        bool reusePort = _impl->config.reusePort;
+        _impl->workers = std::make_unique<WorkerPool>(_impl->config.workerThreads);
+        for (unsigned i = 0; i < _impl->config.eventLoops; ++i) {
+            _impl->loops.push_back(std::make_unique<EventLoop>(*this, *_impl->workers, _impl->activeSessions));
+            if (reusePort)
+                _impl->loops.back()->addListener(Socket::listen(_impl->config.port, QUEUE_MAX, _impl->config.protocol, true));
+        }
+
+        if (!reusePort)
+            listenSock = Socket::listen(_impl->config.port, QUEUE_MAX, _impl->config.protocol);
+    } catch (const SocketException &e) {
+        std::cout << e.what() << "\n";
+        return;
+    }
+
+    for (std::size_t i = _impl->config.reusePort ? 1 : 0; i < _impl->loops.size(); ++i) {
+        std::thread thread(&EventLoop::run, _impl->loops[i].get());
+        thread.detach();
+    }
+
+    // the loops accept on their own listeners, this thread runs the first of them
+    if (_impl->config.reusePort) {
+        _impl->loops.front()->run();
+        return;
+    }
+
+    // hand new connections to the event loops in turn
+    std::size_t next = 0;
+    while (true) {
+        try {
+            Socket connectSock = Socket::accept(listenSock);
+            if (!admitSession(connectSock, _impl->activeSessions, _impl->config.maxSessions))
+                continue;
+
+            _impl->loops[next]->addSession(std::move(connectSock));
+            next = (next + 1) % _impl->loops.size();
+        } catch (const SocketException &e) {
+            std::cout << e.what() << "\n";
+        }
+    }
+}
+
+
+const FtpServerConfig &FtpServer::config() const {
+    return _impl->config;
+}
+
+
+PassivePortAllocator &FtpServer::portAllocator() {
+    return *_impl->portAllocator;
+}
+
+
+AccountStore &FtpServer::accounts() {
+    return *_impl->accounts;
+}
+
+
+WorkerPool &FtpServer::ioWorkers() {
+    return *_impl->ioWorkers;
+}
+
+
+ListingCache &FtpServer::listingCache() {
+    return *_impl->listingCache;
+}
+
+
+Metrics &FtpServer::metrics() {
+    return *_impl->metrics;
+}
+
+
+Logger &FtpServer::logger() {
+    return *_impl->logger;
+}
+
+
+SyncBatcher &FtpServer::syncBatcher() {
+    return *_impl->syncBatcher;
+}
+
+
+TokenBucket *FtpServer::globalRateLimit() {
+    return _impl->globalRateLimit.get();
+}
+
+
+std::shared_ptr<TokenBucket> FtpServer::userRateLimit(const std::string &username, uint64_t bytesPerSecond) {
+    if (bytesPerSecond == 0)
+        return nullptr;
+
+    if (_impl->workersFollowLimits && _impl->workers)
+        _impl->workers->grow(static_cast<unsigned>(_impl->config.maxSessions));
+
+    std::lock_guard<std::mutex> guard(_impl->userRateLimitsMutex);
+    auto &entry = _impl->userRateLimits[username];
+    auto bucket = entry.lock();
+    if (!bucket) {
+        bucket = std::make_shared<TokenBucket>(bytesPerSecond);
+        entry = bucket;
+    }
+
+    // the accounts file may have changed the limit since the bucket was made
+    bucket->setRate(bytesPerSecond);
+
+    // drop the entries of users who logged out
+    for (auto it = _impl->userRateLimits.begin(); it != _impl->userRateLimits.end(); ) {
+        if (it->second.expired())
+            it = _impl->userRateLimits.erase(it);
+        else
+            ++it;
+    }
+
+    return bucket;
+}
+
+
+void runFtpServer(const FtpServerConfig &config) {
+    FtpServer server(config);
+    server.run();
+}
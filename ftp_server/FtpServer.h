@@ -0,0 +1,121 @@
+#ifndef FTPSERVER_H
+#define FTPSERVER_H
+
+#include <memory>
+#include <string>
+#include "Socket.h"
+
+
+class AccountStore;
+class ListingCache;
+class Logger;
+class Metrics;
+class PassivePortAllocator;
+class SyncBatcher;
+class TokenBucket;
+class WorkerPool;
+
+
+// what STOR does to get an upload onto disk before it replies
+enum Durability {
+    NO_SYNC = 0,        // leave it to the page cache
+    FDATASYNC = 1,      // fdatasync every upload before publishing it
+    DIRECT_IO = 2,      // write around the page cache with O_DIRECT, no sync
+    BATCHED_SYNC = 3,   // group the syncs of concurrent uploads into one per file system
+};
+
+
+struct FtpServerConfig {
+    uint16_t    port         = 21;
+    NetProtocol protocol     = IPv6;
+    std::string accountsFile = "accounts";
+
+    // connections, logins, commands and transfers are logged here, nowhere when empty
+    std::string logFile;
+
+    // number of event loops owning the control connections. 0 means one per core
+    unsigned    eventLoops   = 0;
+
+    // give every event loop its own SO_REUSEPORT listener to accept on, instead
+    // of one thread accepting all connections and handing them out
+    bool        reusePort    = false;
+
+    // threads running data transfers off the event loops. 0 means four per core
+    unsigned    workerThreads = 0;
+
+    // connections above this are turned away with 421
+    std::size_t maxSessions  = 1000;
+
+    // size of each of the two buffers a data transfer cycles through
+    std::size_t transferBufferSize = 256 * 1024;
+
+    // threads doing disk reads and writes for transfers. 0 means one per core
+    unsigned    ioThreads    = 0;
+
+    // memory for rendered directory listings shared by all sessions
+    std::size_t listingCacheSize = 16 * 1024 * 1024;
+
+    // ports handed out to PASV and EPSV
+    uint16_t    passivePortMin = 1024;
+    uint16_t    passivePortMax = 65535;
+
+    // move file data with io_uring where the kernel supports it, sendfile otherwise
+    bool        ioUring = false;
+
+    Durability  durability = NO_SYNC;
+
+    // how long a batched sync waits for other uploads to join it
+    unsigned    syncBatchMs = 5;
+
+    // bandwidth limits in bytes per second, 0 means unlimited. Per user limits
+    // come from the accounts file
+    uint64_t    globalRateLimit = 0;
+    uint64_t    sessionRateLimit = 0;
+};
+
+
+class FtpServer {
+public:
+    FtpServer(FtpServerConfig config);
+
+    FtpServer(const FtpServer &) = delete;
+
+    FtpServer &operator=(const FtpServer &) = delete;
+
+    ~FtpServer();
+
+    void run();
+
+    const FtpServerConfig &config() const;
+
+    PassivePortAllocator &portAllocator();
+
+    AccountStore &accounts();
+
+    WorkerPool &ioWorkers();
+
+    ListingCache &listingCache();
+
+    Metrics &metrics();
+
+    Logger &logger();
+
+    // only exists with BATCHED_SYNC durability
+    SyncBatcher &syncBatcher();
+
+    // nullptr when the server has no global limit
+    TokenBucket *globalRateLimit();
+
+    // bucket shared by every session of the user, nullptr when the user is unlimited
+    std::shared_ptr<TokenBucket> userRateLimit(const std::string &username, uint64_t bytesPerSecond);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+
+void runFtpServer(const FtpServerConfig &config);
+
+
+#endif // FTPSERVER_H
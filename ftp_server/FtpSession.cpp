@@ -1,120 +1,214 @@
-#include <map>
 #include <fstream>
 #include <sstream>
 #include <unistd.h>
-#include <thread>
-#include <mutex>
 #include <dirent.h>
 #include <algorithm>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <climits>
 #include <cstring>
+#include <future>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
 #include <stdlib.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
 #include "FtpSession.h"
+#include "FtpServer.h"
+#include "AccountStore.h"
+#include "IoUring.h"
+#include "LineEnding.h"
+#include "ListingCache.h"
+#include "Logger.h"
+#include "Metrics.h"
+#include "Mlsx.h"
+#include "PassivePortAllocator.h"
 #include "Socket.h"
+#include "SyncBatcher.h"
+#include "TokenBucket.h"
+#include "UploadFile.h"
 #include "Utility.h"
+#include "WorkerPool.h"
 
 static const int QUEUE_MAX = 100;
 static const int BUF_MAX   = 2048;
 
+// O_DIRECT needs buffers, lengths and offsets aligned to the logical block size
+static const std::size_t DIRECT_IO_ALIGN = 4096;
+
+// commands that arrive during a transfer are kept up to this many, then left in the socket
+static const std::size_t DEFERRED_MAX = 64;
+
+// replies a client leaves unread are kept up to this many bytes, then it is dropped
+static const std::size_t OUTPUT_MAX = 256 * 1024;
+
 
 /************************************************************
- * runServer definition
+ * FtpUserSession class definition
  ************************************************************/
-static void removeFtpUSerSession(std::vector<std::thread> &threadlist,
-                                 std::mutex &threadlistMutex,
-                                 std::thread::id threadId)
-{
-    std::lock_guard<std::mutex> guard(threadlistMutex);
-    auto thread = std::find_if(threadlist.begin(), threadlist.end(), [&](const std::thread &t){ return t.get_id() == threadId; });
-    if (thread != threadlist.end()) {
-        thread->join();
-        threadlist.erase(thread);
-    }
+// open(2) flags plus RESOLVE_ flags, -1 with ENOSYS where the kernel has no openat2
+static int openResolved(int dirfd, const char *path, int flags, mode_t mode, uint64_t resolve) {
+#ifdef SYS_openat2
+    struct open_how how = {};
+    how.flags   = static_cast<uint64_t>(flags);
+    how.resolve = resolve;
+
+    // unlike open, openat2 rejects a mode that no file is created with
+    if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE)
+        how.mode = mode;
+
+    return static_cast<int>(syscall(SYS_openat2, dirfd, path, &how, sizeof(how)));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
 }
 
 
-static void runFtpUserSession(std::vector<std::thread> &threadlist,
-                              std::mutex &threadlistMutex,
-                              Socket socket, std::string accountsFile)
-{
-    FtpServerPI ftpPI(std::move(socket), accountsFile);
+struct FtpServerPI::Impl {
+    Impl(FtpServer &server)
+        : server{&server}
+        , sessionId{server.logger().nextSessionId()}
+        , ftpDTP{server, sessionId}
+    {}
 
-    try {
-        ftpPI.run();
-    } catch (const std::exception &e) {}
 
-    std::thread removeThread(removeFtpUSerSession,
-                             std::ref(threadlist),
-                             std::ref(threadlistMutex),
-                             std::this_thread::get_id());
-    removeThread.detach();
-}
+    static CommandLine parseCommandLine(std::string_view input) {
+        // strip the telnet end of line
+        while (!input.empty() && (input.back() == '\n' || input.back() == '\r'))
+            input.remove_suffix(1);
 
+        // and the telnet interrupt and synch clients may send ahead of ABOR
+        while (!input.empty() && static_cast<unsigned char>(input.front()) >= 0x80)
+            input.remove_prefix(1);
 
-void runFtpServer(uint16_t port, const std::string &accountsFile, NetProtocol protocol) {
-    Socket listenSock;
-    try {
-        listenSock = Socket::listen(port, QUEUE_MAX, protocol);
-    } catch (const SocketException &e) {
-        std::cout << e.what() << "\n";
-        return;
+        CommandLine line;
+        auto pos = input.find(' ');
+        line.verb = input.substr(0, pos);
+        if (pos != std::string_view::npos)
+            line.argument = input.substr(pos+1);
+
+        return line;
     }
 
-    std::vector<std::thread> threadlist;
-    std::mutex threadlistMutex;
-    while (true) {
-        try {
-            Socket connectSock = Socket::accept(listenSock);
-            std::thread thread(runFtpUserSession,
-                               std::ref(threadlist),
-                               std::ref(threadlistMutex),
-                               std::move(connectSock),
-                               accountsFile);
-
-            // guard threadlist before modified
-            std::lock_guard<std::mutex> guard(threadlistMutex);
-            threadlist.push_back(std::move(thread));
-
-        } catch (const SocketException &e) {
-            std::cout << e.what() << "\n";
+
+    // called with ctrlMutex held, what the socket does not take now waits behind the pending replies
+    void sendCtrl(std::string_view reply) {
+        std::size_t sent = 0;
+        if (pendingOutput.empty())
+            sent = ctrlSock.writeSome(reinterpret_cast<const Byte *>(reply.data()), reply.size());
+
+        if (sent < reply.size()) {
+            pendingOutput.append(reply.substr(sent));
+            if (pendingOutput.size() > OUTPUT_MAX) {
+                errno = ENOBUFS;
+                throw SocketException();
+            }
         }
     }
-}
 
 
-/************************************************************
- * FtpUserSession class definition
- ************************************************************/
-struct FtpServerPI::Impl {
-    std::vector<std::string> parseCommandLine(const std::string &input) {
-        std::vector<std::string> args;
-        for (std::size_t i = 0; i < input.size(); ++i) {
-            if (input[i] == ' ') {
-                auto cmd  = input.substr(0, i);
-                auto rest = input.substr(i+1, input.size()-i - 3);
-                args.push_back(cmd);
-                if (!rest.empty())
-                    args.push_back(rest);
-
-                return args;
+    // reads the next complete command line into line, replying to and skipping the
+    // ones too long to fit. Returns false once the socket has nothing more.
+    bool readCommandLine(FtpServerPI &ftpPI, std::string &line) {
+        while (true) {
+            char input[BUF_MAX];
+            auto rn = ctrlSock.readline(input, BUF_MAX);
+            if (rn == 0)
+                return false;
+
+            bool completeLine = input[rn-1] == '\n';
+            if (!completeLine && ctrlSock.peerClosed())
+                return false;
+
+            if (discardLine)
+                discardLine = !completeLine;
+            else if (!completeLine) {
+                ftpPI.writeCtrl(COMMAND_NOT_RECOGNIZED, "Command too long");
+                discardLine = true;
+            }
+            else {
+                line.assign(input, rn);
+                return true;
             }
         }
+    }
 
-        return { input.substr(0, input.size()-2) };
+
+    // input is taken over by a data transfer, which runs after this returns
+    void executeCommandLine(FtpServerPI &ftpPI, std::string &input) {
+        // begin executing command if it is valid
+        CommandLine line = parseCommandLine(input);
+        if (line.verb.empty()) {
+            ftpPI.writeCtrl(COMMAND_NOT_RECOGNIZED, "Command empty");
+            return;
+        }
+
+        auto cmd = FtpCommand::find(line.verb);
+        if (cmd == nullptr)
+            ftpPI.writeCtrl(COMMAND_NOT_RECOGNIZED, "Unrecognized command");
+        else if (cmd->needsLogin() && !ftpPI.loggedIn)
+            ftpPI.writeCtrl(USER_NOT_LOGGED_IN, "Not logged in");
+        else if (cmd->transfersData()) {
+            // data transfers block, so they are run outside of the event loop
+            pendingCmd = cmd;
+            pendingInput.swap(input);
+            pendingLine = parseCommandLine(pendingInput);
+
+            std::lock_guard<std::mutex> guard(transferMutex);
+            transferRunning = true;
+            abortRequested  = false;
+            ftpDTP.resetAbort();
+        }
+        else
+            cmd->run(&ftpPI, line);
     }
 
+
     Socket      ctrlSock;
-    std::string accountsFile;
+    FtpServer   *server;
+    uint64_t    sessionId;
     FtpServerDTP ftpDTP;
-    std::map<std::string, std::unique_ptr<FtpCommand>> loginCommands;
-    std::map<std::string, std::unique_ptr<FtpCommand>> commands;
+    bool        discardLine;
+    const FtpCommand *pendingCmd;
+    std::string pendingInput;
+    CommandLine pendingLine;
+
+    // buffers kept across commands so that their memory is reused
+    std::string lineBuffer;
+    std::string replyBuffer;
+    std::deque<std::string> deferredLines;
+
+    // O_PATH fds the kernel resolves user paths from
+    FileDescriptor homeDir;
+    FileDescriptor workingDir;
+
+    // replies come from both the event loop and the transfer thread
+    std::mutex  ctrlMutex;
+
+    // replies the socket had no room for, sent when the event loop sees it writable
+    std::string pendingOutput;
+
+    // whether the transfer thread still has to reply, decides who answers ABOR
+    std::mutex  transferMutex;
+    bool        transferRunning;
+    bool        abortRequested;
 };
 
 
-FtpServerPI::FtpServerPI(Socket ctrlSock, std::string accountsFile) {
-    _impl = std::make_unique<Impl>();
+const int FtpServerPI::TIME_OUT;
+
+
+FtpServerPI::FtpServerPI(Socket ctrlSock, FtpServer &server) {
+    _impl = std::make_unique<Impl>(server);
     _impl->ctrlSock        = std::move(ctrlSock);
-    _impl->accountsFile    = std::move(accountsFile);
+    _impl->discardLine     = false;
+    _impl->pendingCmd      = nullptr;
+    _impl->transferRunning = false;
+    _impl->abortRequested  = false;
 
     // shared state variables
     username          = "";
@@ -123,90 +217,155 @@ FtpServerPI::FtpServerPI(Socket ctrlSock, std::string accountsFile) {
     EPSVexclusive     = false;
     loggedIn          = false;
     quit              = false;
+    restartOffset     = 0;
+    allocSize         = 0;
+}
 
-    // initiate login commands
-    _impl->loginCommands.insert({USERCommand::PROG, std::make_unique<USERCommand>(this)});
-    _impl->loginCommands.insert({PASSCommand::PROG, std::make_unique<PASSCommand>(this)});
-    _impl->loginCommands.insert({QUITCommand::PROG, std::make_unique<QUITCommand>(this)});
 
-    // initiate normal commands
-    _impl->commands.insert({TYPECommand::PROG, std::make_unique<TYPECommand>(this)});
-    _impl->commands.insert({ PWDCommand::PROG, std::make_unique<PWDCommand>(this)});
-    _impl->commands.insert({ CWDCommand::PROG, std::make_unique<CWDCommand>(this)});
-    _impl->commands.insert({CDUPCommand::PROG, std::make_unique<CDUPCommand>(this)});
-    _impl->commands.insert({PORTCommand::PROG, std::make_unique<PORTCommand>(this)});
-    _impl->commands.insert({EPRTCommand::PROG, std::make_unique<EPRTCommand>(this)});
-    _impl->commands.insert({PASVCommand::PROG, std::make_unique<PASVCommand>(this)});
-    _impl->commands.insert({EPSVCommand::PROG, std::make_unique<EPSVCommand>(this)});
-    _impl->commands.insert({LISTCommand::PROG, std::make_unique<LISTCommand>(this)});
-    _impl->commands.insert({RETRCommand::PROG, std::make_unique<RETRCommand>(this)});
-    _impl->commands.insert({STORCommand::PROG, std::make_unique<STORCommand>(this)});
+FtpServerPI::~FtpServerPI() {
+    _impl->server->logger().log(Logger::DISCONNECT, _impl->sessionId, "");
 }
 
 
-FtpServerPI::~FtpServerPI()
-{}
+void FtpServerPI::start() {
+    _impl->server->logger().log(Logger::CONNECT, _impl->sessionId, _impl->ctrlSock.peerIPAddr());
+    writeCtrl(SERVICE_READY, "Service ready");
+}
 
 
-void FtpServerPI::run() {
-    writeCtrl(SERVICE_READY, "Service ready");
+void FtpServerPI::onReadable() {
+    // commands that came in during the last transfer go first
+    while (!quit && !hasPendingTransfer() && !_impl->deferredLines.empty()) {
+        std::string line = std::move(_impl->deferredLines.front());
+        _impl->deferredLines.pop_front();
+        _impl->executeCommandLine(*this, line);
+    }
 
-    while (true) {
-        // check if session is quit
-        if (quit)
-            break;
+    // read command from client, stops once the kernel has nothing left
+    std::string &line = _impl->lineBuffer;
+    while (!quit && !hasPendingTransfer() && _impl->readCommandLine(*this, line))
+        _impl->executeCommandLine(*this, line);
+}
 
-        // poll for any activity
-        int res = _impl->ctrlSock.pollForRead(TIME_OUT);
-        if (res == 0 || res == -1) {
-            writeCtrl(SERVICE_UNAVAILABLE, "Time out");
-            break;
-        }
 
-        // read command from client
-        char input[BUF_MAX];
-        auto rn = _impl->ctrlSock.readline(input, BUF_MAX);
-        if (rn >= BUF_MAX) {
-            writeCtrl(COMMAND_NOT_RECOGNIZED, "Command too long");
-            continue;
-        }
-        input[rn] = '\0';
+void FtpServerPI::onReadableDuringTransfer() {
+    std::string &input = _impl->lineBuffer;
+    while (_impl->deferredLines.size() < DEFERRED_MAX && _impl->readCommandLine(*this, input)) {
+        CommandLine line = Impl::parseCommandLine(input);
 
-        // begin executing command if it is valid
-        std::vector<std::string> args = _impl->parseCommandLine(input);
-        if (args.empty()) {
-            writeCtrl(COMMAND_NOT_RECOGNIZED, "Command empty");
-            continue;
-        }
+        // only commands about the transfer itself are answered while it runs
+        auto cmd = FtpCommand::find(line.verb);
+        if (cmd != nullptr && cmd->runsDuringTransfer())
+            cmd->run(this, line);
+        else
+            _impl->deferredLines.push_back(input);
+    }
+
+    // nobody is left to receive the data
+    if (_impl->ctrlSock.peerClosed())
+        abortTransfer();
+}
+
+
+bool FtpServerPI::abortTransfer() {
+    std::lock_guard<std::mutex> guard(_impl->transferMutex);
+    if (!_impl->transferRunning)
+        return false;
+
+    _impl->abortRequested = true;
+    _impl->ftpDTP.abort();
+    return true;
+}
 
-        // command is a login command
-        std::transform(args[0].begin(), args[0].end(), args[0].begin(), ::toupper);
-        auto loginCmd = _impl->loginCommands.find(args[0]);
-        if (loginCmd != _impl->loginCommands.end()) {
-            loginCmd->second->execute(args);
-            continue;
-        }
 
-        // command is a normal command required login
-        auto cmd = _impl->commands.find(args[0]);
-        if (cmd == _impl->commands.end())
-            writeCtrl(COMMAND_NOT_RECOGNIZED, "Unrecognized command");
-        else if (loggedIn)
-            cmd->second->execute(args);
+bool FtpServerPI::hasPendingTransfer() const {
+    return _impl->pendingCmd != nullptr;
+}
+
+
+void FtpServerPI::runPendingTransfer() {
+    auto cmd = _impl->pendingCmd;
+    if (!cmd)
+        return;
+
+    try {
+        cmd->run(this, _impl->pendingLine);
+
+        // the transfer has answered with 426 by now, the reply to ABOR follows it
+        std::lock_guard<std::mutex> guard(_impl->transferMutex);
+        _impl->transferRunning = false;
+        if (_impl->abortRequested)
+            writeCtrl(CLOSE_DATA_CONNECTION_REQUEST_FILE_ACTION_SUCCESS, "Abort successful");
+    } catch (const std::exception &) {
+        quit = true;
+    }
+}
+
+
+void FtpServerPI::finishPendingTransfer() {
+    // a restart point or an allocation applies to the one transfer that follows it
+    _impl->pendingCmd = nullptr;
+    _impl->pendingLine = CommandLine();
+    _impl->pendingInput.clear();
+    restartOffset = 0;
+    allocSize     = 0;
+
+    std::lock_guard<std::mutex> guard(_impl->transferMutex);
+    _impl->transferRunning = false;
+}
+
+
+bool FtpServerPI::closed() const {
+    return quit || _impl->ctrlSock.peerClosed();
+}
+
+
+void FtpServerPI::writeCtrl(FtpCode code, std::string_view msg) {
+    std::lock_guard<std::mutex> guard(_impl->ctrlMutex);
+    std::string &reply = _impl->replyBuffer;
+    reply = std::to_string(code);
+    reply += ' ';
+    reply += msg;
+    reply += "\r\n";
+    _impl->sendCtrl(reply);
+}
+
+
+void FtpServerPI::writeCtrlMultiline(FtpCode code, const std::vector<std::string> &lines) {
+    // RFC 959 multiline reply, only the first and the last line carry the code
+    std::string reply;
+    for (std::size_t i = 0; i < lines.size(); ++i) {
+        if (i == 0)
+            reply += std::to_string(code) + (lines.size() == 1 ? " " : "-") + lines[i] + "\r\n";
+        else if (i == lines.size()-1)
+            reply += std::to_string(code) + " " + lines[i] + "\r\n";
         else
-            writeCtrl(USER_NOT_LOGGED_IN, "Not logged in");
+            reply += " " + lines[i] + "\r\n";
     }
+
+    std::lock_guard<std::mutex> guard(_impl->ctrlMutex);
+    _impl->sendCtrl(reply);
+}
+
+
+bool FtpServerPI::flushCtrl() {
+    std::lock_guard<std::mutex> guard(_impl->ctrlMutex);
+    std::string &output = _impl->pendingOutput;
+    if (!output.empty())
+        output.erase(0, _impl->ctrlSock.writeSome(reinterpret_cast<const Byte *>(output.data()), output.size()));
+
+    return !output.empty();
 }
 
 
-void FtpServerPI::writeCtrl(FtpCode code, const std::string &msg) {
-    std::string reply = std::to_string(code) + " " + msg + "\r\n";
-    _impl->ctrlSock.write(reinterpret_cast<const Byte *>(reply.data()), reply.size());
+bool FtpServerPI::hasPendingOutput() const {
+    std::lock_guard<std::mutex> guard(_impl->ctrlMutex);
+    return !_impl->pendingOutput.empty();
 }
 
 
-const std::string &FtpServerPI::accountsFile() const {
-    return _impl->accountsFile;
+FtpServer &FtpServerPI::server() {
+    return *_impl->server;
 }
 
 
@@ -215,6 +374,119 @@ std::string FtpServerPI::serverIPAddr() const {
 }
 
 
+uint64_t FtpServerPI::sessionId() const {
+    return _impl->sessionId;
+}
+
+
+bool FtpServerPI::convertToNativePath(std::string_view userPath, char (&nativePath)[PATH_MAX]) const {
+    bool absolutePath = !userPath.empty() && userPath[0] == '/';
+    std::size_t size = userNativeHomeDir.size() + 2 + userPath.size();
+    if (!absolutePath)
+        size += userWorkingDir.size() + 1;
+
+    nativePath[0] = '\0';
+    if (size >= PATH_MAX)
+        return false;
+
+    // "/home/" followed by the user path, which is normalized where it was copied
+    char *out = nativePath;
+    *out++ = '/';
+    out = std::copy(userNativeHomeDir.begin(), userNativeHomeDir.end(), out);
+    *out++ = '/';
+
+    char *userPart = out;
+    if (!absolutePath) {
+        out = std::copy(userWorkingDir.begin(), userWorkingDir.end(), out);
+        *out++ = '/';
+    }
+    out = std::copy(userPath.begin(), userPath.end(), out);
+
+    userPart[normalizePath(std::string_view(userPart, out - userPart), userPart)] = '\0';
+    return true;
+}
+
+
+bool FtpServerPI::openHomeDir(const std::string &nativeHomeDir) {
+    userNativeHomeDir = nativeHomeDir;
+    userWorkingDir    = "";
+
+    std::string path = "/" + nativeHomeDir;
+    _impl->homeDir.reset(open(path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+    _impl->workingDir.reset(open(path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+    return _impl->homeDir.isValid() && _impl->workingDir.isValid();
+}
+
+
+bool FtpServerPI::changeWorkingDir(std::string_view userPath) {
+    // the directory is opened by its normalized name, so that PWD shows the one
+    // the fd is on
+    char nativePath[PATH_MAX];
+    if (!convertToNativePath(userPath, nativePath))
+        return false;
+
+    const char *workingDir = nativePath + userNativeHomeDir.size() + 1;
+    FileDescriptor dir(openUserPath(workingDir, O_PATH | O_DIRECTORY | O_CLOEXEC));
+    if (!dir.isValid())
+        return false;
+
+    _impl->workingDir = std::move(dir);
+    userWorkingDir.assign(workingDir + 1);
+    return true;
+}
+
+
+int FtpServerPI::openUserPath(std::string_view userPath, int flags, mode_t mode) const {
+    static std::atomic<bool> openat2Supported{true};
+
+    char path[PATH_MAX];
+    bool absolutePath = !userPath.empty() && userPath[0] == '/';
+    if (openat2Supported) {
+        // relative paths are walked from the working directory first
+        int fd = -1;
+        errno = EXDEV;
+        if (!absolutePath && userPath.size() < PATH_MAX) {
+            *std::copy(userPath.begin(), userPath.end(), path) = '\0';
+            fd = openResolved(_impl->workingDir.get(), userPath.empty() ? "." : path, flags, mode,
+                              RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS);
+        }
+
+        // and from home when they climb out of it. Home is the root there, so
+        // neither ".." nor an absolute symlink gets above it
+        if (fd == -1 && errno == EXDEV) {
+            std::size_t size = userPath.size() + (absolutePath ? 0 : userWorkingDir.size() + 2);
+            if (size >= PATH_MAX) {
+                errno = ENAMETOOLONG;
+                return -1;
+            }
+
+            char *out = path;
+            if (!absolutePath) {
+                *out++ = '/';
+                out = std::copy(userWorkingDir.begin(), userWorkingDir.end(), out);
+                *out++ = '/';
+            }
+            *std::copy(userPath.begin(), userPath.end(), out) = '\0';
+            fd = openResolved(_impl->homeDir.get(), path, flags, mode,
+                              RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS);
+        }
+
+        if (fd != -1 || errno != ENOSYS)
+            return fd;
+
+        openat2Supported = false;
+    }
+
+    // kernels before 5.6 confine the path by normalizing it onto home instead
+    if (!convertToNativePath(userPath, path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    return open(path, flags, mode);
+}
+
+
 FtpServerDTP &FtpServerPI::DTP() {
     return _impl->ftpDTP;
 }
@@ -224,32 +496,209 @@ FtpServerDTP &FtpServerPI::DTP() {
  * FtpServerDTP class definition
  ************************************************************/
 struct FtpServerDTP::Impl {
-    void writeBinaryMode(std::istream &data) {
-        Byte buf[BUF_MAX];
-        std::streamsize size = BUF_MAX;
-        while (data) {
-            data.read(reinterpret_cast<char *>(buf), size);
-            dataSock.write(buf, static_cast<std::size_t>(data.gcount()));
+    // Moves data through two buffers so that disk and network work overlap: while one
+    // buffer is drained the other is filled. The disk side runs on the io workers, it is
+    // the fill side when diskFills is set and the drain side otherwise.
+    template<typename Fill, typename Drain>
+    void pipeline(Fill fill, Drain drain, bool diskFills) {
+        std::size_t size = bufferSize();
+        AlignedBuffer buffers[2] = { allocateBuffer(size), allocateBuffer(size) };
+        Byte *curr = buffers[0].get();
+        Byte *next = buffers[1].get();
+
+        std::future<std::size_t> pending;
+        auto runOnDisk = [this](std::function<std::size_t()> work) {
+            auto task = std::make_shared<std::packaged_task<std::size_t()>>(std::move(work));
+            auto future = task->get_future();
+            server->ioWorkers().submit([task]() { (*task)(); });
+            return future;
+        };
+
+        try {
+            if (diskFills) {
+                std::size_t n = fill(curr, size);
+                while (n > 0) {
+                    checkAborted();
+                    pending = runOnDisk([&fill, next, size]() { return fill(next, size); });
+                    throttle(n);
+                    drain(curr, n);
+                    transferred += n;
+                    n = pending.get();
+                    std::swap(curr, next);
+                }
+            }
+            else {
+                std::size_t n = fill(curr, size);
+                while (n > 0) {
+                    transferred += n;
+                    throttle(n, true);
+                    checkAborted();
+                    if (pending.valid())
+                        pending.get();
+
+                    pending = runOnDisk([&drain, curr, n]() { drain(curr, n); return n; });
+                    std::swap(curr, next);
+                    n = fill(curr, size);
+                }
+
+                if (pending.valid())
+                    pending.get();
+            }
+        } catch (...) {
+            // the io worker may still be using a buffer
+            if (pending.valid())
+                pending.wait();
+
+            throw;
         }
     }
 
 
+    void writeBinaryMode(std::istream &data) {
+        auto fill = [&data](Byte *buf, std::size_t size) {
+            data.read(reinterpret_cast<char *>(buf), static_cast<std::streamsize>(size));
+            return static_cast<std::size_t>(data.gcount());
+        };
+
+        auto drain = [this](const Byte *buf, std::size_t size) {
+            dataSock.write(buf, size);
+        };
+
+        pipeline(fill, drain, true);
+    }
+
+
     void writeAsciiMode(std::istream &data) {
-        while (data) {
-            std::string line;
-            std::getline(data, line);
-            if (!line.empty()) {
-                line.back() = '\r';
-                line += "\n";
+        // fills never overlap, so they can share the raw buffer and the converter.
+        // Half a buffer is read so that it fits even if every byte is a LF
+        std::size_t rawSize = bufferSize() / 2;
+        std::unique_ptr<char[]> raw = std::make_unique<char[]>(rawSize);
+        LfToCrlf converter;
+        auto fill = [&data, &raw, rawSize, &converter](Byte *buf, std::size_t) {
+            data.read(raw.get(), static_cast<std::streamsize>(rawSize));
+            return converter.convert(raw.get(), static_cast<std::size_t>(data.gcount()), reinterpret_cast<char *>(buf));
+        };
+
+        auto drain = [this](const Byte *buf, std::size_t size) {
+            dataSock.write(buf, size);
+        };
+
+        pipeline(fill, drain, true);
+    }
+
+
+    bool useIoUring() const {
+        return server->config().ioUring && ioUringSupported();
+    }
+
+
+    void releasePassivePort() {
+        if (!activeMode && connectSetup)
+            portAllocator->release(port);
+    }
+
+
+    // buffers are whole pages and page aligned so they can be written with O_DIRECT
+    using AlignedBuffer = std::unique_ptr<Byte, void (*)(void *)>;
+
+    std::size_t bufferSize() const {
+        return std::max(DIRECT_IO_ALIGN, server->config().transferBufferSize / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN);
+    }
+
+
+    static AlignedBuffer allocateBuffer(std::size_t size) {
+        void *buf = nullptr;
+        if (posix_memalign(&buf, DIRECT_IO_ALIGN, size) != 0)
+            throw std::bad_alloc();
+
+        return AlignedBuffer(static_cast<Byte *>(buf), free);
+    }
+
+
+    // writes all of buf at offset. A file opened with O_DIRECT takes whole aligned
+    // blocks only, the unaligned end of an upload is written through the page cache
+    static void writeFile(int fd, const Byte *buf, std::size_t size, off_t offset) {
+        int flags = fcntl(fd, F_GETFL);
+        if (flags != -1 && (flags & O_DIRECT) && (size % DIRECT_IO_ALIGN != 0 || offset % DIRECT_IO_ALIGN != 0)) {
+            std::size_t aligned = offset % DIRECT_IO_ALIGN == 0 ? size / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN : 0;
+            writeFile(fd, buf, aligned, offset);
+            if (fcntl(fd, F_SETFL, flags & ~O_DIRECT) == -1)
+                throw SocketException();
+
+            buf    += aligned;
+            size   -= aligned;
+            offset += static_cast<off_t>(aligned);
+        }
+
+        while (size > 0) {
+            ssize_t n = ::pwrite(fd, buf, size, offset);
+            if (n == -1 && errno == EINTR)
+                continue;
+
+            if (n == -1)
+                throw SocketException();
+
+            buf    += n;
+            size   -= static_cast<std::size_t>(n);
+            offset += n;
+        }
+    }
+
+
+    // waits until every limit that applies lets the bytes through. The wait
+    // holds the worker, which is why a limited server gets a pool per session.
+    // Bytes that are only about to move are given back when the transfer
+    // aborts during the wait, bytes already moved have used the bandwidth.
+    void throttle(std::size_t bytes, bool alreadyMoved = false) {
+        std::chrono::nanoseconds wait(0);
+        auto buckets = { sessionRateLimit.get(), userRateLimit.get(), server->globalRateLimit() };
+        for (TokenBucket *bucket : buckets) {
+            if (bucket)
+                wait = std::max(wait, bucket->reserve(bytes));
+        }
+
+        // sleep in slices so that a limited transfer still aborts promptly
+        while (wait.count() > 0 && !aborted) {
+            auto slice = std::min<std::chrono::nanoseconds>(wait, std::chrono::milliseconds(100));
+            std::this_thread::sleep_for(slice);
+            wait -= slice;
+        }
+
+        if (wait.count() > 0 && !alreadyMoved) {
+            for (TokenBucket *bucket : buckets) {
+                if (bucket)
+                    bucket->refund(bytes);
             }
 
-            dataSock.write(reinterpret_cast<const Byte *>(line.c_str()), line.size());
+            checkAborted();
+        }
+    }
+
+
+    // a shut down socket can also end a transfer with what looks like a clean end of data
+    void checkAborted() const {
+        if (aborted) {
+            errno = ECANCELED;
+            throw SocketException();
         }
     }
 
 
+    FtpServer *server;
+    PassivePortAllocator *portAllocator;
+
+    // abort() runs on the event loop while the transfer thread opens and closes the
+    // sockets, so they are only replaced while holding socketMutex
+    std::mutex socketMutex;
     Socket passiveSock;
     Socket dataSock;
+    std::atomic<bool> aborted;
+    std::atomic<uint64_t> transferred;
+    std::atomic<int64_t> transferStart;
+    std::unique_ptr<TokenBucket> sessionRateLimit;
+    std::shared_ptr<TokenBucket> userRateLimit;
+    Metrics::Direction direction;
+    uint64_t sessionId;
     std::string receiverIP;
     NetProtocol netProtocol;
     TransferMode transferMode;
@@ -259,21 +708,31 @@ struct FtpServerDTP::Impl {
 };
 
 
-FtpServerDTP::FtpServerDTP() {
+FtpServerDTP::FtpServerDTP(FtpServer &server, uint64_t sessionId) {
     _impl = std::make_unique<Impl>();
+    _impl->server = &server;
+    _impl->sessionId = sessionId;
+    _impl->portAllocator = &server.portAllocator();
     _impl->passiveSock  = Socket();
     _impl->dataSock     = Socket();
     _impl->receiverIP   = "";
     _impl->netProtocol  = UNSPECIFIED;
     _impl->transferMode = ASCII;
-    _impl->port         = USABLE_PORT_MIN;
+    _impl->port         = 0;
     _impl->activeMode   = true;
     _impl->connectSetup = false;
+    _impl->aborted      = false;
+    _impl->transferred  = 0;
+    _impl->transferStart = 0;
+    _impl->direction    = Metrics::SENT;
+    if (server.config().sessionRateLimit > 0)
+        _impl->sessionRateLimit = std::make_unique<TokenBucket>(server.config().sessionRateLimit);
 }
 
 
-FtpServerDTP::~FtpServerDTP()
-{}
+FtpServerDTP::~FtpServerDTP() {
+    _impl->releasePassivePort();
+}
 
 
 void FtpServerDTP::setTransferMode(TransferMode mode) {
@@ -292,21 +751,87 @@ bool FtpServerDTP::doesDataConnectSetup() const {
 
 
 void FtpServerDTP::closeDataConnect() {
-    _impl->passiveSock  = Socket();
-    _impl->dataSock     = Socket();
+    _impl->releasePassivePort();
+    {
+        std::lock_guard<std::mutex> guard(_impl->socketMutex);
+        _impl->passiveSock = Socket();
+        _impl->dataSock    = Socket();
+    }
+
+    // a transfer ends here whether it succeeded or not
+    int64_t start = _impl->transferStart.exchange(0);
+    if (start != 0) {
+        auto elapsed = std::chrono::steady_clock::now().time_since_epoch() - std::chrono::steady_clock::duration(start);
+        _impl->server->metrics().recordTransfer(_impl->direction, _impl->transferred, elapsed);
+        _impl->server->logger().log(_impl->direction == Metrics::SENT ? Logger::TRANSFER_SENT : Logger::TRANSFER_RECEIVED,
+                                    _impl->sessionId, "", _impl->transferred,
+                                    std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    }
+
     _impl->receiverIP   = "";
     _impl->netProtocol  = UNSPECIFIED;
-    _impl->port         = USABLE_PORT_MIN;
+    _impl->port         = 0;
     _impl->activeMode   = true;
     _impl->connectSetup = false;
 }
 
 
 void FtpServerDTP::openData() {
+    _impl->checkAborted();
+
+    Socket dataSock;
     if (_impl->activeMode)
-        _impl->dataSock = Socket::connect(_impl->receiverIP, _impl->port);
-    else
-        _impl->dataSock = Socket::accept(_impl->passiveSock);
+        dataSock = Socket::connect(_impl->receiverIP, _impl->port, CONNECT_TIME_OUT);
+    else {
+        // a client that never connects must not keep the worker
+        int ready = _impl->passiveSock.pollForRead(CONNECT_TIME_OUT);
+        if (ready == 0)
+            errno = ETIMEDOUT;
+
+        if (ready <= 0)
+            throw SocketException();
+
+        dataSock = Socket::accept(_impl->passiveSock);
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(_impl->socketMutex);
+        _impl->dataSock = std::move(dataSock);
+    }
+
+    _impl->checkAborted();
+    _impl->transferred = 0;
+    _impl->transferStart = std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+
+void FtpServerDTP::setUserRateLimit(std::shared_ptr<TokenBucket> limit) {
+    _impl->userRateLimit = std::move(limit);
+}
+
+
+void FtpServerDTP::resetAbort() {
+    _impl->aborted = false;
+}
+
+
+void FtpServerDTP::abort() {
+    std::lock_guard<std::mutex> guard(_impl->socketMutex);
+    _impl->aborted = true;
+    _impl->dataSock.shutdown();
+    _impl->passiveSock.shutdown();
+}
+
+
+bool FtpServerDTP::transferProgress(uint64_t &bytes, double &seconds) const {
+    int64_t start = _impl->transferStart;
+    if (start == 0)
+        return false;
+
+    bytes = _impl->transferred;
+    auto elapsed = std::chrono::steady_clock::now().time_since_epoch() - std::chrono::steady_clock::duration(start);
+    seconds = std::chrono::duration<double>(elapsed).count();
+    return true;
 }
 
 
@@ -314,6 +839,12 @@ void FtpServerDTP::setupActiveMode(const std::string &receiverIP,
                                    uint16_t port,
                                    NetProtocol protocol)
 {
+    _impl->releasePassivePort();
+    {
+        std::lock_guard<std::mutex> guard(_impl->socketMutex);
+        _impl->passiveSock = Socket();
+    }
+
     _impl->receiverIP   = receiverIP;
     _impl->netProtocol  = protocol;
     _impl->port         = port;
@@ -322,114 +853,338 @@ void FtpServerDTP::setupActiveMode(const std::string &receiverIP,
 }
 
 
-void FtpServerDTP::setupPassiveMode(uint16_t port, NetProtocol protocol) {
-    _impl->passiveSock = Socket::listen(port, QUEUE_MAX, protocol);
-    _impl->netProtocol  = protocol;
-    _impl->port         = port;
-    _impl->activeMode   = false;
-    _impl->connectSetup = true;
+uint16_t FtpServerDTP::setupPassiveMode(NetProtocol protocol) {
+    // a new PASV replaces the previous passive port
+    _impl->releasePassivePort();
+    {
+        std::lock_guard<std::mutex> guard(_impl->socketMutex);
+        _impl->passiveSock = Socket();
+    }
+
+    _impl->connectSetup = false;
+
+    for (int attempt = 0; attempt < PASSIVE_BIND_ATTEMPTS; ++attempt) {
+        uint16_t port;
+        if (!_impl->portAllocator->acquire(port))
+            break;
+
+        Socket passiveSock;
+        try {
+            passiveSock = Socket::listen(port, QUEUE_MAX, protocol);
+        } catch (const SocketException &) {
+            // port is used outside of the server, put it back to be tried later
+            _impl->portAllocator->release(port);
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(_impl->socketMutex);
+            _impl->passiveSock = std::move(passiveSock);
+        }
+
+        _impl->netProtocol  = protocol;
+        _impl->port         = port;
+        _impl->activeMode   = false;
+        _impl->connectSetup = true;
+        return port;
+    }
+
+    errno = EADDRINUSE;
+    throw SocketException();
 }
 
 
 void FtpServerDTP::writeData(std::istream &data) {
+    _impl->direction = Metrics::SENT;
     if (_impl->transferMode == BINARY)
         _impl->writeBinaryMode(data);
     else if (_impl->transferMode == ASCII)
         _impl->writeAsciiMode(data);
+
+    _impl->checkAborted();
 }
 
 
-void FtpServerDTP::readData(std::ostream &data) {
-    Byte buf[BUF_MAX];
-    std::size_t rn;
-    while ((rn = _impl->dataSock.read(buf, BUF_MAX)) != 0) {
-        data.write(reinterpret_cast<const char *>(buf), rn);
+void FtpServerDTP::writeFile(int fd, off_t offset) {
+    struct stat fstat;
+    if (::fstat(fd, &fstat) == -1)
+        throw SocketException();
+
+    _impl->direction = Metrics::SENT;
+
+    // binary transfer needs no conversion, let the kernel move the pages
+    auto size = static_cast<std::size_t>(std::max<off_t>(fstat.st_size - offset, 0));
+    if (_impl->useIoUring()) {
+        auto progress = [this](std::size_t n) { _impl->transferred += n; _impl->throttle(n, true); };
+        ioUringSendFile(_impl->dataSock.nativeHandle(), fd, offset, size, _impl->server->config().transferBufferSize, progress);
+    }
+    else {
+        // sent a buffer size at a time so that progress shows up in STAT
+        std::size_t chunk = _impl->server->config().transferBufferSize;
+        while (size > 0) {
+            _impl->throttle(std::min(size, chunk));
+            std::size_t sent = _impl->dataSock.sendFile(fd, offset, std::min(size, chunk));
+            if (sent == 0)
+                break;
+
+            _impl->transferred += sent;
+            offset += static_cast<off_t>(sent);
+            size   -= sent;
+        }
     }
+
+    _impl->checkAborted();
+}
+
+
+void FtpServerDTP::writeData(const char *data, std::size_t size) {
+    _impl->direction = Metrics::SENT;
+    _impl->throttle(size);
+    _impl->dataSock.write(reinterpret_cast<const Byte *>(data), size);
+    _impl->transferred += size;
+    _impl->checkAborted();
+}
+
+
+void FtpServerDTP::readData(int fd, off_t offset) {
+    _impl->direction = Metrics::RECEIVED;
+
+    // the ring's buffers are not meant for O_DIRECT
+    bool directIo = (fcntl(fd, F_GETFL) & O_DIRECT) != 0;
+    if (_impl->transferMode == BINARY && _impl->useIoUring() && !directIo) {
+        auto progress = [this](std::size_t n) { _impl->transferred += n; _impl->throttle(n, true); };
+        ioUringRecvFile(_impl->dataSock.nativeHandle(), fd, offset, _impl->server->config().transferBufferSize, progress);
+        _impl->checkAborted();
+        return;
+    }
+
+    // drains run one after the other, so they can share the offset
+    auto drain = [fd, &offset](const Byte *buf, std::size_t size) {
+        Impl::writeFile(fd, buf, size, offset);
+        offset += static_cast<off_t>(size);
+    };
+
+    if (_impl->transferMode == BINARY) {
+        auto fill = [this](Byte *buf, std::size_t size) {
+            return _impl->dataSock.read(buf, size);
+        };
+
+        _impl->pipeline(fill, drain, false);
+        _impl->checkAborted();
+        return;
+    }
+
+    // receive one byte into the buffer so the conversion can run in place, leaving
+    // room for a CR held back from the previous read
+    CrlfToLf converter;
+    auto fill = [this, &converter](Byte *buf, std::size_t size) {
+        auto out = reinterpret_cast<char *>(buf);
+        while (true) {
+            std::size_t n = _impl->dataSock.read(buf + 1, size - 1);
+            if (n == 0)
+                return converter.finish(out);
+
+            // a lone CR converts to nothing yet, which would read as the end of data
+            n = converter.convert(out + 1, n, out);
+            if (n > 0)
+                return n;
+        }
+    };
+
+    _impl->pipeline(fill, drain, false);
+    _impl->checkAborted();
 }
 
 
 /************************************************************
  * FtpCommand class definition
  ************************************************************/
-struct FtpCommand::Impl {
-    FtpServerPI *session;
+// in the order of their metrics ids
+static constexpr FtpCommand COMMANDS[] = {
+    { USERCommand::PROG, &USERCommand::execute, 0 },
+    { PASSCommand::PROG, &PASSCommand::execute, 0 },
+    { QUITCommand::PROG, &QUITCommand::execute, 0 },
+    { FEATCommand::PROG, &FEATCommand::execute, 0 },
+    { TYPECommand::PROG, &TYPECommand::execute, FtpCommand::NEEDS_LOGIN },
+    {  PWDCommand::PROG,  &PWDCommand::execute, FtpCommand::NEEDS_LOGIN },
+    {  CWDCommand::PROG,  &CWDCommand::execute, FtpCommand::NEEDS_LOGIN },
+    { CDUPCommand::PROG, &CDUPCommand::execute, FtpCommand::NEEDS_LOGIN },
+    { PORTCommand::PROG, &PORTCommand::execute, FtpCommand::NEEDS_LOGIN },
+    { EPRTCommand::PROG, &EPRTCommand::execute, FtpCommand::NEEDS_LOGIN },
+    { PASVCommand::PROG, &PASVCommand::execute, FtpCommand::NEEDS_LOGIN },
+    { EPSVCommand::PROG, &EPSVCommand::execute, FtpCommand::NEEDS_LOGIN },
+    { LISTCommand::PROG, &LISTCommand::execute, FtpCommand::NEEDS_LOGIN | FtpCommand::TRANSFERS_DATA },
+    { RETRCommand::PROG, &RETRCommand::execute, FtpCommand::NEEDS_LOGIN | FtpCommand::TRANSFERS_DATA },
+    { STORCommand::PROG, &STORCommand::execute, FtpCommand::NEEDS_LOGIN | FtpCommand::TRANSFERS_DATA },
+    { APPECommand::PROG, &APPECommand::execute, FtpCommand::NEEDS_LOGIN | FtpCommand::TRANSFERS_DATA },
+    { RESTCommand::PROG, &RESTCommand::execute, FtpCommand::NEEDS_LOGIN },
+    { ALLOCommand::PROG, &ALLOCommand::execute, FtpCommand::NEEDS_LOGIN },
+    { ABORCommand::PROG, &ABORCommand::execute, FtpCommand::NEEDS_LOGIN | FtpCommand::RUNS_DURING_TRANSFER },
+    { STATCommand::PROG, &STATCommand::execute, FtpCommand::NEEDS_LOGIN | FtpCommand::RUNS_DURING_TRANSFER },
+    { SITECommand::PROG, &SITECommand::execute, FtpCommand::NEEDS_LOGIN },
+    { MLSTCommand::PROG, &MLSTCommand::execute, FtpCommand::NEEDS_LOGIN },
+    { MLSDCommand::PROG, &MLSDCommand::execute, FtpCommand::NEEDS_LOGIN | FtpCommand::TRANSFERS_DATA },
 };
 
+static constexpr int COMMAND_COUNT = sizeof(COMMANDS) / sizeof(COMMANDS[0]);
 
-FtpCommand::FtpCommand(FtpServerPI *session) {
-    _impl = std::make_unique<Impl>();
-    _impl->session = session;
+// verbs are three or four letters, packed little endian into a word. Clearing bit 5
+// of every byte makes letters upper case
+static constexpr uint32_t CASE_FOLD = 0xDFDFDFDF;
+
+// multiplicative hash into 64 slots, the multiplier is one under which the verbs
+// above do not collide
+static constexpr uint32_t HASH_MULTIPLIER = 0x9E3779B3;
+static constexpr int HASH_BITS = 6;
+
+
+static constexpr uint32_t packVerb(const char *verb) {
+    uint32_t packed = 0;
+    for (int i = 0; i < 4 && verb[i] != '\0'; ++i)
+        packed |= static_cast<uint32_t>(static_cast<unsigned char>(verb[i])) << (8 * i);
+
+    return packed & CASE_FOLD;
 }
 
 
-FtpCommand::~FtpCommand()
-{}
+static constexpr uint32_t slotOf(uint32_t packed) {
+    return (packed * HASH_MULTIPLIER) >> (32 - HASH_BITS);
+}
+
 
+static constexpr bool collisionFree() {
+    for (int i = 0; i < COMMAND_COUNT; ++i) {
+        for (int j = i + 1; j < COMMAND_COUNT; ++j) {
+            if (slotOf(packVerb(COMMANDS[i].name)) == slotOf(packVerb(COMMANDS[j].name)))
+                return false;
+        }
+    }
 
-FtpServerPI *FtpCommand::PI() {
-    return _impl->session;
+    return true;
 }
 
 
-std::string FtpCommand::convertToNativePath(const std::string &userPath) {
-    auto ftpPI = PI();
+static_assert(collisionFree(), "two verbs share a dispatch slot, pick another HASH_MULTIPLIER");
 
-    std::string nativePath;
-    if (!userPath.empty()) {
-        bool absolutePath = userPath[0] == '/';
-        nativePath = absolutePath ?
-                                 normalizePath(userPath) :
-                                 normalizePath(ftpPI->userWorkingDir + "/" + userPath);
 
-        nativePath = "/" + ftpPI->userNativeHomeDir + "/" + nativePath;
+// slot -> packed verb and table position, an empty slot holds verb 0
+struct DispatchTable {
+    constexpr DispatchTable()
+        : verbs{}
+        , ids{}
+    {
+        for (int id = 0; id < COMMAND_COUNT; ++id) {
+            uint32_t packed = packVerb(COMMANDS[id].name);
+            verbs[slotOf(packed)] = packed;
+            ids[slotOf(packed)]   = static_cast<uint8_t>(id);
+        }
+    }
+
+    uint32_t verbs[1 << HASH_BITS];
+    uint8_t  ids[1 << HASH_BITS];
+};
+
+
+static constexpr DispatchTable DISPATCH{};
+
+
+int FtpCommand::id() const {
+    return static_cast<int>(this - COMMANDS);
+}
+
+
+void FtpCommand::run(FtpServerPI *ftpPI, const CommandLine &line) const {
+    auto start = std::chrono::steady_clock::now();
+    auto record = [this, ftpPI, &line, start]() {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        ftpPI->server().metrics().recordCommand(id(), elapsed);
+
+        // passwords stay out of the log, the logger cuts what does not fit
+        char text[Logger::TEXT_MAX];
+        std::string_view argument = handler == &PASSCommand::execute ? "****" : line.argument;
+        std::size_t len = std::strlen(name);
+        std::memcpy(text, name, len);
+        if (line.hasArgument()) {
+            text[len++] = ' ';
+            auto copied = std::min(argument.size(), sizeof(text) - len);
+            std::memcpy(text + len, argument.data(), copied);
+            len += copied;
+        }
+
+        ftpPI->server().logger().log(Logger::COMMAND, ftpPI->sessionId(), std::string_view(text, len), 0,
+                                     std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    };
+
+    try {
+        handler(ftpPI, line);
+    } catch (...) {
+        record();
+        throw;
     }
-    else
-        nativePath = "/" + ftpPI->userNativeHomeDir + "/" + ftpPI->userWorkingDir;
 
-    return nativePath;
+    record();
+}
+
+
+const FtpCommand *FtpCommand::find(std::string_view verb) {
+    if (verb.size() < 3 || verb.size() > 4)
+        return nullptr;
+
+    // anything but letters would fold into some other byte
+    uint32_t packed = 0;
+    for (std::size_t i = 0; i < verb.size(); ++i) {
+        auto c = static_cast<unsigned char>(verb[i]);
+        if (static_cast<unsigned char>((c | 0x20) - 'a') >= 26)
+            return nullptr;
+
+        packed |= static_cast<uint32_t>(c) << (8 * i);
+    }
+
+    packed &= CASE_FOLD;
+    auto slot = slotOf(packed);
+    return DISPATCH.verbs[slot] == packed ? &COMMANDS[DISPATCH.ids[slot]] : nullptr;
+}
+
+
+int FtpCommand::count() {
+    return COMMAND_COUNT;
+}
+
+
+const FtpCommand &FtpCommand::byId(int id) {
+    return COMMANDS[id];
 }
 
 
 /************************************************************
  * TYPECommand class definition
  ************************************************************/
-const std::string TYPECommand::PROG = "TYPE";
-
-
-void TYPECommand::execute(const std::vector<std::string> &args) {
-    auto ftpPI = PI();
+void TYPECommand::execute(FtpServerPI *ftpPI, const CommandLine &line) {
     auto &ftpDTP = ftpPI->DTP();
 
-    if (args.size() != 2) {
+    if (!line.hasArgument()) {
         ftpPI->writeCtrl(COMMAND_ARGS_NOT_RECOGNIZED, "Cannot recognize code type");
         return;
     }
 
-    if (args[1] == "a" || args[1] == "A") {
+    if (line.argument == "a" || line.argument == "A") {
         ftpPI->writeCtrl(COMMAND_OK , "Switch to ASCII mode");
         ftpDTP.setTransferMode(ASCII);
     }
-    else if (args[1] == "i" || args[1] == "I") {
+    else if (line.argument == "i" || line.argument == "I") {
         ftpPI->writeCtrl(COMMAND_OK, "Switch to BINARY mode");
         ftpDTP.setTransferMode(BINARY);
     }
     else
-        ftpPI->writeCtrl(COMMAND_NOT_IMPLEMENTED_FOR_ARGS , "Type " + args[1] + " not implemented");
+        ftpPI->writeCtrl(COMMAND_NOT_IMPLEMENTED_FOR_ARGS , "Type " + std::string(line.argument) + " not implemented");
 }
 
 
 /************************************************************
  * USERCommand class definition
  ************************************************************/
-const std::string USERCommand::PROG = "USER";
-
-
-void USERCommand::execute(const std::vector<std::string> &args) {
-    auto ftpPI = PI();
-    std::string username;
-    if (args.size() == 2)
-        username = std::move(args[1]);
-
+void USERCommand::execute(FtpServerPI *ftpPI, const CommandLine &line) {
+    std::string_view username = line.argument;
     if (!ftpPI->loggedIn) {
         ftpPI->username = username;
         ftpPI->writeCtrl(USER_OK_PASSWORD_NEEDED, "Please specify the password");
@@ -444,11 +1199,7 @@ void USERCommand::execute(const std::vector<std::string> &args) {
 /************************************************************
  * PASSCommand class definition
  ************************************************************/
-const std::string PASSCommand::PROG = "PASS";
-
-
-void PASSCommand::execute(const std::vector<std::string> &args) {
-    auto ftpPI = PI();
+void PASSCommand::execute(FtpServerPI *ftpPI, const CommandLine &line) {
     if (ftpPI->loggedIn) {
         ftpPI->writeCtrl(USER_LOGGED_IN_PROCCEED, "Already logged in");
         return;
@@ -458,32 +1209,34 @@ void PASSCommand::execute(const std::vector<std::string> &args) {
         return;
     }
 
-    std::string pass;
-    if (args.size() == 2)
-        pass = std::move(args[1]);
+    std::string_view pass = line.argument;
 
-    std::ifstream accounts(ftpPI->accountsFile());
-    if (!accounts) {
+    auto &accounts = ftpPI->server().accounts();
+    if (!accounts.isLoaded()) {
         ftpPI->writeCtrl(USER_NOT_LOGGED_IN, "Accounts file not found");
         return;
     }
 
-    std::string actualUser, actualPass, actualHomeDir;
-    while (accounts >> actualUser &&
-           accounts >> actualPass &&
-           accounts >> actualHomeDir)
-    {
-        if (actualUser == ftpPI->username &&
-            actualPass == pass)
-        {
-            ftpPI->loggedIn = true;
-            ftpPI->userNativeHomeDir = normalizePath(actualHomeDir);
-            ftpPI->userWorkingDir = "";
-            ftpPI->writeCtrl(USER_LOGGED_IN_PROCCEED, "User logged in, proceed");
+    Account account;
+    if (accounts.find(ftpPI->username, account) && account.password == pass) {
+        // every path of the session is resolved from the home directory
+        if (!ftpPI->openHomeDir(account.nativeHomeDir)) {
+            ftpPI->server().logger().log(Logger::LOGIN_FAILED, ftpPI->sessionId(),
+                                         ftpPI->username + ": cannot open home directory " + account.nativeHomeDir);
+            ftpPI->username = "";
+            ftpPI->writeCtrl(USER_NOT_LOGGED_IN, "Cannot open home directory");
             return;
         }
+
+        ftpPI->loggedIn = true;
+        ftpPI->DTP().setUserRateLimit(ftpPI->server().userRateLimit(ftpPI->username, account.rateLimit));
+        ftpPI->server().logger().log(Logger::LOGIN, ftpPI->sessionId(), ftpPI->username);
+        ftpPI->writeCtrl(USER_LOGGED_IN_PROCCEED, "User logged in, proceed");
+        return;
     }
 
+    ftpPI->server().logger().log(Logger::LOGIN_FAILED, ftpPI->sessionId(), ftpPI->username);
+
     ftpPI->loggedIn = false;
     ftpPI->username = "";
     ftpPI->writeCtrl(USER_NOT_LOGGED_IN, "Login incorrect");
@@ -493,37 +1246,21 @@ void PASSCommand::execute(const std::vector<std::string> &args) {
 /************************************************************
  * PWDCommand class definition
  ************************************************************/
-const std::string PWDCommand::PROG = "PWD";
-
-
-void PWDCommand::execute(const std::vector<std::string> &) {
-    auto ftpPI = PI();
-    std::string workingDir = "/" + ftpPI->userWorkingDir;
-    ftpPI->writeCtrl(PATHNAME_CREATED, "\"" + workingDir + "\" is the current directory");
+void PWDCommand::execute(FtpServerPI *ftpPI, const CommandLine &) {
+    char reply[PATH_MAX + 64];
+    int len = snprintf(reply, sizeof(reply), "\"/%s\" is the current directory", ftpPI->userWorkingDir.c_str());
+    ftpPI->writeCtrl(PATHNAME_CREATED, std::string_view(reply, std::min<std::size_t>(len, sizeof(reply) - 1)));
 }
 
 
 /************************************************************
  * CWDCommand class definition
  ************************************************************/
-const std::string CWDCommand::PROG = "CWD";
+void CWDCommand::execute(FtpServerPI *ftpPI, const CommandLine &line) {
 
-
-void CWDCommand::execute(const std::vector<std::string> &args) {
-    auto ftpPI = PI();
-
-    std::string userWorkingDir;
-    if (args.size() == 2) {
-        bool absolutePath = args[1][0] == '/';
-        userWorkingDir = absolutePath ?
-                                      normalizePath(args[1]) :
-                                      normalizePath(ftpPI->userWorkingDir + "/" + args[1]);
-    }
-
-    if (isDiretory("/" + ftpPI->userNativeHomeDir + "/" + userWorkingDir)) {
-        ftpPI->userWorkingDir = userWorkingDir;
+    // no argument goes back to the home directory
+    if (ftpPI->changeWorkingDir(line.hasArgument() ? line.argument : "/"))
         ftpPI->writeCtrl(REQUESTED_FILE_ACTION_COMPLETED , "Directory change okay");
-    }
     else
         ftpPI->writeCtrl(REQUESTED_FILE_ACTION_NOT_TAKEN_FILE_UNAVAILABLE, "Failed to change directory");
 }
@@ -532,17 +1269,10 @@ void CWDCommand::execute(const std::vector<std::string> &args) {
 /************************************************************
  * CDUPCommand class definition
  ************************************************************/
-const std::string CDUPCommand::PROG = "CDUP";
-
-
-void CDUPCommand::execute(const std::vector<std::string> &) {
-    auto ftpPI = PI();
+void CDUPCommand::execute(FtpServerPI *ftpPI, const CommandLine &) {
 
-    std::string userWorkingDir = normalizePath(ftpPI->userWorkingDir + "/..");
-    if (isDiretory("/" + ftpPI->userNativeHomeDir + "/" + userWorkingDir)) {
-        ftpPI->userWorkingDir = userWorkingDir;
+    if (ftpPI->changeWorkingDir(".."))
         ftpPI->writeCtrl(REQUESTED_FILE_ACTION_COMPLETED , "Directory change okay");
-    }
     else
         ftpPI->writeCtrl(REQUESTED_FILE_ACTION_NOT_TAKEN_FILE_UNAVAILABLE, "Failed to change directory");
 }
@@ -551,11 +1281,7 @@ void CDUPCommand::execute(const std::vector<std::string> &) {
 /************************************************************
  * QUITCommand class definition
  ************************************************************/
-const std::string QUITCommand::PROG = "QUIT";
-
-
-void QUITCommand::execute(const std::vector<std::string> &) {
-    auto ftpPI = PI();
+void QUITCommand::execute(FtpServerPI *ftpPI, const CommandLine &) {
     ftpPI->quit = true;
     ftpPI->writeCtrl(SERVICE_CLOSE_CTRL_CONNECTION, "Goodbye");
 }
@@ -564,11 +1290,7 @@ void QUITCommand::execute(const std::vector<std::string> &) {
 /************************************************************
  * PORTCommand class definition
  ************************************************************/
-const std::string PORTCommand::PROG = "PORT";
-
-
-void PORTCommand::execute(const std::vector<std::string> &args) {
-    auto ftpPI = PI();
+void PORTCommand::execute(FtpServerPI *ftpPI, const CommandLine &line) {
     auto &ftpDTP = ftpPI->DTP();
 
     if (ftpPI->EPSVexclusive) {
@@ -576,13 +1298,13 @@ void PORTCommand::execute(const std::vector<std::string> &args) {
         return;
     }
 
-    if (args.size() != 2) {
+    if (!line.hasArgument()) {
         ftpPI->writeCtrl(COMMAND_ARGS_NOT_RECOGNIZED, "Cannot recognize IP address and port number");
         return;
     }
 
-    std::vector<std::string> PORTArgs = splitString(args[1], ",");
-    if (PORTArgs.size() != 6) {
+    std::array<std::string_view, 6> PORTArgs;
+    if (splitView(line.argument, ',', PORTArgs) != PORTArgs.size()) {
         ftpPI->writeCtrl(COMMAND_ARGS_NOT_RECOGNIZED, "Cannot recognize IP address and port number");
         return;
     }
@@ -602,7 +1324,9 @@ void PORTCommand::execute(const std::vector<std::string> &args) {
             rightPort = num;
     }
 
-    std::string receiverIPAddress = joinString(PORTArgs.begin(), PORTArgs.begin()+4, ".");
+    // h1,h2,h3,h4 is the address with commas for dots
+    std::string receiverIPAddress(line.argument.substr(0, PORTArgs[4].data() - line.argument.data() - 1));
+    std::replace(receiverIPAddress.begin(), receiverIPAddress.end(), ',', '.');
     uint16_t port = (leftPort << 8 & 0xFFFF) | rightPort;
 
     ftpDTP.setupActiveMode(receiverIPAddress, port, IPv4);
@@ -613,11 +1337,7 @@ void PORTCommand::execute(const std::vector<std::string> &args) {
 /************************************************************
  * EPRTCommand class definition
  ************************************************************/
-const std::string EPRTCommand::PROG = "EPRT";
-
-
-void EPRTCommand::execute(const std::vector<std::string> &args) {
-    auto ftpPI = PI();
+void EPRTCommand::execute(FtpServerPI *ftpPI, const CommandLine &line) {
     auto &ftpDTP = ftpPI->DTP();
 
     if (ftpPI->EPSVexclusive) {
@@ -625,14 +1345,13 @@ void EPRTCommand::execute(const std::vector<std::string> &args) {
         return;
     }
 
-    if (args.size() != 2 || args[1].back() != '|' || args[1].front() != '|') {
+    if (!line.hasArgument() || line.argument.back() != '|' || line.argument.front() != '|') {
         ftpPI->writeCtrl(COMMAND_ARGS_NOT_RECOGNIZED, "EPRT command args not recognized");
         return;
     }
 
-    std::size_t size = args[1].size();
-    std::vector<std::string> EPRTargs = splitString(args[1].substr(1, size-2), "|");
-    if (EPRTargs.size() != 3) {
+    std::array<std::string_view, 3> EPRTargs;
+    if (line.argument.size() < 2 || splitView(line.argument.substr(1, line.argument.size()-2), '|', EPRTargs) != 3) {
         ftpPI->writeCtrl(COMMAND_ARGS_NOT_RECOGNIZED, "EPRT command args not recognized");
         return;
     }
@@ -647,7 +1366,7 @@ void EPRTCommand::execute(const std::vector<std::string> &args) {
         return;
     }
 
-    std::string receiverIP = EPRTargs[1];
+    std::string receiverIP(EPRTargs[1]);
     uint16_t port;
     if (toUnsignedInt(EPRTargs[2], port) != 0)
         return;
@@ -660,11 +1379,7 @@ void EPRTCommand::execute(const std::vector<std::string> &args) {
 /************************************************************
  * PASVCommand class definition
  ************************************************************/
-const std::string PASVCommand::PROG = "PASV";
-
-
-void PASVCommand::execute(const std::vector<std::string> &) {
-    auto ftpPI = PI();
+void PASVCommand::execute(FtpServerPI *ftpPI, const CommandLine &) {
     auto &ftpDTP = ftpPI->DTP();
 
     if (ftpPI->EPSVexclusive) {
@@ -672,51 +1387,41 @@ void PASVCommand::execute(const std::vector<std::string> &) {
         return;
     }
 
-    for (uint16_t port = FtpServerDTP::USABLE_PORT_MAX; port >= FtpServerDTP::USABLE_PORT_MIN; --port) {
-        try {
-            ftpDTP.setupPassiveMode(port, IPv4);
-        } catch (const SocketException &e) {
-            continue;
-        }
-
-        // add ip address to reply
-        std::string reply = "Entering passive mode (";
-        auto ipn = splitString(ftpPI->serverIPAddr(), ".");
-        for (const auto &n : ipn)
-            reply += n + ",";
+    uint16_t port;
+    try {
+        port = ftpDTP.setupPassiveMode(IPv4);
+    } catch (const SocketException &) {
+        ftpPI->writeCtrl(CANNOT_OPEN_DATA_CONNECTION, "No passive port available");
+        return;
+    }
 
-        // add first 8 bits and second 8 bits of port number to cmd
-        std::string p1 = std::to_string(port >> 8);
-        std::string p2 = std::to_string(port & 0x00FF);
-        reply += p1 + "," + p2 + ")";
+    // ip address with commas for dots, then the first and the second 8 bits of the port
+    std::string ip = ftpPI->serverIPAddr();
+    std::replace(ip.begin(), ip.end(), '.', ',');
 
-        ftpPI->writeCtrl(ENTERING_PASSIVE_MODE, reply);
-        break;
-    }
+    char reply[64];
+    snprintf(reply, sizeof(reply), "Entering passive mode (%s,%d,%d)", ip.c_str(), port >> 8, port & 0x00FF);
+    ftpPI->writeCtrl(ENTERING_PASSIVE_MODE, reply);
 }
 
 
 /************************************************************
  * EPSVCommand class definition
  ************************************************************/
-const std::string EPSVCommand::PROG = "EPSV";
-
-
-void EPSVCommand::execute(const std::vector<std::string> &args) {
-    auto ftpPI = PI();
+void EPSVCommand::execute(FtpServerPI *ftpPI, const CommandLine &line) {
     auto &ftpDTP = ftpPI->DTP();
 
-    if (args.size() != 2) {
+    if (!line.hasArgument()) {
         ftpPI->writeCtrl(COMMAND_ARGS_NOT_RECOGNIZED, "EPSV command args not recognized");
         return;
     }
 
     NetProtocol protocol;
-    if (args[1] == "1")
+    if (line.argument == "1")
         protocol = IPv4;
-    else if (args[1] == "2")
+    else if (line.argument == "2")
         protocol = IPv6;
-    else if (args[1] == "ALL") {
+    else if (line.argument == "ALL") {
         ftpPI->EPSVexclusive = true;
         ftpPI->writeCtrl(ENTERING_EXTENDED_PASSIVE_MODE, "EPSV ALL ok");
         return;
@@ -726,63 +1431,66 @@ void EPSVCommand::execute(const std::vector<std::string> &args) {
         return;
     }
 
-    for (uint16_t port = FtpServerDTP::USABLE_PORT_MAX; port >= FtpServerDTP::USABLE_PORT_MIN; --port) {
-        try {
-            ftpDTP.setupPassiveMode(port, protocol);
-        } catch (const SocketException &) {
-            continue;
-        }
-
-        // add ip address to reply
-        std::string reply = "Entering extended passive mode (|||" + std::to_string(port) + "|)";
-        ftpPI->writeCtrl(ENTERING_EXTENDED_PASSIVE_MODE, reply);
-        break;
+    uint16_t port;
+    try {
+        port = ftpDTP.setupPassiveMode(protocol);
+    } catch (const SocketException &) {
+        ftpPI->writeCtrl(CANNOT_OPEN_DATA_CONNECTION, "No passive port available");
+        return;
     }
+
+    // add ip address to reply
+    std::string reply = "Entering extended passive mode (|||" + std::to_string(port) + "|)";
+    ftpPI->writeCtrl(ENTERING_EXTENDED_PASSIVE_MODE, reply);
 }
 
 
 /************************************************************
  * LISTCommand class definition
  ************************************************************/
-const std::string LISTCommand::PROG = "LIST";
-
-
-void LISTCommand::execute(const std::vector<std::string> &args) {
-    auto ftpPI = PI();
+void LISTCommand::execute(FtpServerPI *ftpPI, const CommandLine &line) {
     auto &ftpDTP = ftpPI->DTP();
 
-    // get the path to list info
-    std::string nativePath;
-    if (args.size() == 2)
-        nativePath = convertToNativePath(args[1]);
-    else
-        nativePath = convertToNativePath("");
+    // get the path to list info. The cache knows directories by their native path,
+    // so the path is opened by its normalized name to be the one the key names
+    char nativePath[PATH_MAX];
+    FileDescriptor file;
+    if (ftpPI->convertToNativePath(line.argument, nativePath))
+        file.reset(ftpPI->openUserPath(nativePath + ftpPI->userNativeHomeDir.size() + 1, O_PATH | O_CLOEXEC));
 
-    // get directory list
+    // get directory list, from the cache if the directory has not changed since
     std::stringstream directoryList;
-    DIR *dir;
-    struct stat fstat;
-    if ((dir = opendir(nativePath.c_str())) != nullptr) {
+    auto &listingCache = ftpPI->server().listingCache();
+    DIR *dir = nullptr;
+    struct stat dirStat;
+    bool exists = file.isValid() && ::fstat(file.get(), &dirStat) == 0;
+    bool isDir = exists && S_ISDIR(dirStat.st_mode);
+    auto cached = isDir ? listingCache.find(nativePath, dirStat) : nullptr;
+    if (cached)
+        directoryList.str(*cached);
+    else if (isDir && (dir = fdopendir(openat(file.get(), ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC))) != nullptr) {
+        struct stat fstat;
         dirent *dirent;
         while ((dirent = readdir(dir)) != nullptr) {
             if (std::strcmp(dirent->d_name, ".") == 0 || std::strcmp(dirent->d_name, "..") == 0)
                 continue;
 
-            std::string path = nativePath + "/" + dirent->d_name;
-            if (stat(path.c_str(), &fstat) == 0) {
+            if (fstatat(dirfd(dir), dirent->d_name, &fstat, 0) == 0) {
                 printFileStat(directoryList, fstat);
 
                 directoryList << "\t";
                 directoryList << dirent->d_name << "\r\n";
             }
         }
+
+        closedir(dir);
+        listingCache.insert(nativePath, dirStat, directoryList.str());
     }
-    else if (stat(nativePath.c_str(), &fstat) == 0) {
-        printFileStat(directoryList, fstat);
+    else if (exists) {
+        printFileStat(directoryList, dirStat);
 
         directoryList << "\t";
-        auto pos = nativePath.find_last_of("/");
-        directoryList << nativePath.substr(pos+1) << "\r\n";
+        directoryList << std::strrchr(nativePath, '/') + 1 << "\r\n";
     }
 
     // check if data connection setup
@@ -822,26 +1530,25 @@ void LISTCommand::execute(const std::vector<std::string> &args) {
 /************************************************************
  * RETRCommand class definition
  ************************************************************/
-const std::string RETRCommand::PROG = "RETR";
-
-
-void RETRCommand::execute(const std::vector<std::string> &args) {
-    auto ftpPI = PI();
+void RETRCommand::execute(FtpServerPI *ftpPI, const CommandLine &line) {
     auto &ftpDTP = ftpPI->DTP();
 
     // open file
-    std::string nativePath;
-    if (args.size() == 2)
-        nativePath = convertToNativePath(args[1]);
-    else
-        nativePath = convertToNativePath("");
+    FileDescriptor file(ftpPI->openUserPath(line.argument, O_RDONLY | O_CLOEXEC));
 
-    std::ifstream file(nativePath, std::ios::in | std::ios::binary);
-    if (!isRegularFile(nativePath)) {
+    struct stat fstat;
+    if (!file.isValid() || ::fstat(file.get(), &fstat) == -1 || !S_ISREG(fstat.st_mode)) {
         ftpPI->writeCtrl(REQUESTED_FILE_ACTION_NOT_TAKEN_FILE_UNAVAILABLE, "Failed to open file");
         return;
     }
 
+    // resume from the offset given by REST
+    auto offset = static_cast<off_t>(ftpPI->restartOffset);
+    if (offset > fstat.st_size) {
+        ftpPI->writeCtrl(INVALID_RESTART_POSITION, "Restart position beyond end of file");
+        return;
+    }
+
     // check if data connection setup
     if (!ftpDTP.doesDataConnectSetup()) {
         ftpDTP.closeDataConnect();
@@ -862,7 +1569,15 @@ void RETRCommand::execute(const std::vector<std::string> &args) {
     ftpPI->writeCtrl(FILE_STATUS_OK_OPEN_DATA_CONNECTION, "Open data connection for file transfer");
 
     try {
-        ftpDTP.writeData(file);
+        if (ftpDTP.transferMode() == BINARY)
+            ftpDTP.writeFile(file.get(), offset);
+        else {
+            // the file that was opened, whatever its name resolves to now
+            std::ifstream stream("/proc/self/fd/" + std::to_string(file.get()), std::ios::in | std::ios::binary);
+            stream.seekg(offset);
+            ftpDTP.writeData(stream);
+        }
+
         ftpDTP.closeDataConnect();
         ftpPI->writeCtrl(CLOSE_DATA_CONNECTION_REQUEST_FILE_ACTION_SUCCESS, "Data connection close file sent OK");
 
@@ -880,37 +1595,88 @@ void RETRCommand::execute(const std::vector<std::string> &args) {
 /************************************************************
  * STORCommand class definition
  ************************************************************/
-const std::string STORCommand::PROG = "STOR";
+// applies the durability policy of the server to an upload before it is published
+static bool syncUpload(FtpServer &server, int fd) {
+    switch (server.config().durability) {
+    case FDATASYNC:
+        return fdatasync(fd) == 0;
+    case BATCHED_SYNC:
+        return server.syncBatcher().sync(fd);
+    default:
+        return true;
+    }
+}
 
 
-void STORCommand::execute(const std::vector<std::string> &args) {
-    auto ftpPI = PI();
+// a synced upload is only durable once the directory holding its name is
+static bool syncUploadDir(FtpServer &server, UploadFile &upload) {
+    switch (server.config().durability) {
+    case FDATASYNC:
+        return upload.syncDirectory();
+    case BATCHED_SYNC:
+        return upload.syncDirectory(&server.syncBatcher());
+    default:
+        return true;
+    }
+}
+
+
+void STORCommand::execute(FtpServerPI *ftpPI, const CommandLine &line) {
+    store(ftpPI, line, false);
+}
+
+
+void STORCommand::store(FtpServerPI *ftpPI, const CommandLine &line, bool append) {
     auto &ftpDTP = ftpPI->DTP();
 
-    // get the file to be stored
-    std::string nativePath;
-    if (args.size() == 2) {
-        nativePath = convertToNativePath(args[1]);
-    }
-    else {
-        nativePath = convertToNativePath("");
-    }
+    // get the file to be stored and the directory it goes in
+    std::string_view userPath = line.argument;
+    auto pos = userPath.rfind('/');
+    std::string_view userDir = pos == std::string_view::npos ? "" : pos == 0 ? "/" : userPath.substr(0, pos);
+    std::string_view name = pos == std::string_view::npos ? userPath : userPath.substr(pos + 1);
 
-    // create temp file to ensure atomic operation when saving file
-    char temp[] = "/tmp/fileXXXXXX";
-    int fd = mkstemp(temp);
-    if (fd == -1) {
-        ftpPI->writeCtrl(REQUESTED_ACTION_ABORTED_LOCAL_ERROR_PROCESSING, "Failed to create file");
+    char nativePath[PATH_MAX];
+    if (name.empty() || name == "." || name == ".." || !ftpPI->convertToNativePath(userPath, nativePath)) {
+        ftpPI->writeCtrl(REQUESTED_ACTION_NOT_TAKEN_FILENAME_NOT_ALLOWED, "File name not allowed");
         return;
     }
-    close(fd);
 
-    std::ofstream file(temp);
-    if (!file) {
+    // appending and resuming write into the file itself from where it ends or from the
+    // restart point, anything else goes to a new file first so the target is replaced at once
+    bool inPlace = append || ftpPI->restartOffset > 0;
+    UploadFile upload(FileDescriptor(ftpPI->openUserPath(userDir, O_PATH | O_DIRECTORY | O_CLOEXEC)), std::string(name));
+    FileDescriptor file;
+    off_t offset = 0;
+    if (inPlace) {
+        file.reset(ftpPI->openUserPath(userPath, O_WRONLY | O_CLOEXEC | (append ? O_CREAT : 0), 0644));
+        struct stat fstat;
+        if (!file.isValid() || ::fstat(file.get(), &fstat) == -1 || !S_ISREG(fstat.st_mode)) {
+            ftpPI->writeCtrl(REQUESTED_FILE_ACTION_NOT_TAKEN_FILE_UNAVAILABLE, "Failed to open file");
+            return;
+        }
+
+        offset = append ? fstat.st_size : static_cast<off_t>(ftpPI->restartOffset);
+        if (offset > fstat.st_size) {
+            ftpPI->writeCtrl(INVALID_RESTART_POSITION, "Restart position beyond end of file");
+            return;
+        }
+
+        // what follows the restart point is sent again
+        if (!append && ftruncate(file.get(), offset) == -1) {
+            ftpPI->writeCtrl(REQUESTED_ACTION_ABORTED_LOCAL_ERROR_PROCESSING, "Failed to resume file");
+            return;
+        }
+    }
+    else if (!upload.open(ftpPI->server().config().durability == DIRECT_IO)) {
         ftpPI->writeCtrl(REQUESTED_ACTION_ABORTED_LOCAL_ERROR_PROCESSING, "Failed to create file");
         return;
     }
 
+    // reserve the space announced by ALLO so the file is written in one piece
+    int fd = inPlace ? file.get() : upload.fd();
+    if (ftpPI->allocSize > 0)
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, static_cast<off_t>(ftpPI->allocSize));
+
     // check if data connection setup
     if (!ftpDTP.doesDataConnectSetup()) {
         ftpDTP.closeDataConnect();
@@ -931,15 +1697,31 @@ void STORCommand::execute(const std::vector<std::string> &args) {
     ftpPI->writeCtrl(FILE_STATUS_OK_OPEN_DATA_CONNECTION, "Open data connection for file transfer");
 
     try {
-        ftpDTP.readData(file);
+        ftpDTP.readData(fd, offset);
+
+        if (!syncUpload(ftpPI->server(), fd)) {
+            ftpDTP.closeDataConnect();
+            ftpPI->writeCtrl(REQUESTED_ACTION_ABORTED_LOCAL_ERROR_PROCESSING, "Failed to save file");
+            return;
+        }
 
-        // save temp file and rename it to the file to be saved
-        file.flush();
-        if (std::rename(temp, nativePath.c_str()) == -1) {
+        // put the new file in place of the target
+        if (!inPlace && !upload.publish()) {
+            ftpDTP.closeDataConnect();
             ftpPI->writeCtrl(REQUESTED_ACTION_ABORTED_LOCAL_ERROR_PROCESSING, "Failed to create file");
             return;
         }
 
+        // appending may have created the file as well
+        if ((!inPlace || append) && !syncUploadDir(ftpPI->server(), upload)) {
+            ftpDTP.closeDataConnect();
+            ftpPI->writeCtrl(REQUESTED_ACTION_ABORTED_LOCAL_ERROR_PROCESSING, "Failed to save file");
+            return;
+        }
+
+        // do not wait for inotify to drop the listing of the directory
+        ftpPI->server().listingCache().invalidate(std::string(nativePath, std::strrchr(nativePath, '/')));
+
         ftpDTP.closeDataConnect();
         ftpPI->writeCtrl(CLOSE_DATA_CONNECTION_REQUEST_FILE_ACTION_SUCCESS, "Data connection close file sent OK");
 
@@ -952,3 +1734,219 @@ void STORCommand::execute(const std::vector<std::string> &args) {
     }
 }
 
+
+/************************************************************
+ * APPECommand class definition
+ ************************************************************/
+void APPECommand::execute(FtpServerPI *ftpPI, const CommandLine &line) {
+    store(ftpPI, line, true);
+}
+
+
+/************************************************************
+ * ALLOCommand class definition
+ ************************************************************/
+void ALLOCommand::execute(FtpServerPI *ftpPI, const CommandLine &line) {
+
+    // the record size of "ALLO size R record" does not matter to stream mode
+    uint64_t size;
+    std::array<std::string_view, 3> sizeArgs;
+    if (splitView(line.argument, ' ', sizeArgs) > sizeArgs.size() || sizeArgs[0].empty() ||
+        toUnsignedInt(sizeArgs[0], size) != 0 ||
+        size > static_cast<uint64_t>(std::numeric_limits<off_t>::max()))
+    {
+        ftpPI->writeCtrl(COMMAND_ARGS_NOT_RECOGNIZED, "Invalid allocation size");
+        return;
+    }
+
+    ftpPI->allocSize = size;
+    ftpPI->writeCtrl(COMMAND_OK, "Space for " + std::string(sizeArgs[0]) + " bytes reserved on STOR");
+}
+
+
+/************************************************************
+ * RESTCommand class definition
+ ************************************************************/
+void RESTCommand::execute(FtpServerPI *ftpPI, const CommandLine &line) {
+
+    // only stream mode markers, that is byte offsets, are supported
+    uint64_t offset;
+    if (!line.hasArgument() || toUnsignedInt(line.argument, offset) != 0 ||
+        offset > static_cast<uint64_t>(std::numeric_limits<off_t>::max()))
+    {
+        ftpPI->writeCtrl(COMMAND_ARGS_NOT_RECOGNIZED, "Invalid restart position");
+        return;
+    }
+
+    ftpPI->restartOffset = offset;
+    ftpPI->writeCtrl(REQUESTED_FILE_ACTION_PENDING_FOR_FURTHER_INFO,
+                     "Restarting at " + std::string(line.argument) + ". Send STOR or RETR to initiate transfer");
+}
+
+
+/************************************************************
+ * ABORCommand class definition
+ ************************************************************/
+void ABORCommand::execute(FtpServerPI *ftpPI, const CommandLine &) {
+
+    // the transfer thread replies once the transfer has stopped
+    if (ftpPI->abortTransfer())
+        return;
+
+    ftpPI->DTP().closeDataConnect();
+    ftpPI->writeCtrl(DATA_CONNECTION_OPEN_NO_TRANSFER_IN_PROGRESS, "No transfer to abort");
+}
+
+
+/************************************************************
+ * STATCommand class definition
+ ************************************************************/
+void STATCommand::execute(FtpServerPI *ftpPI, const CommandLine &line) {
+    auto &ftpDTP = ftpPI->DTP();
+
+    if (line.hasArgument()) {
+        ftpPI->writeCtrl(COMMAND_NOT_IMPLEMENTED_FOR_ARGS, "Status of files not implemented");
+        return;
+    }
+
+    std::vector<std::string> lines;
+    lines.push_back("FTP server status:");
+    lines.push_back("Logged in as " + ftpPI->username);
+    lines.push_back(ftpDTP.transferMode() == BINARY ? "TYPE: BINARY" : "TYPE: ASCII");
+
+    uint64_t bytes;
+    double seconds;
+    if (ftpDTP.transferProgress(bytes, seconds)) {
+        char progress[128];
+        snprintf(progress, sizeof(progress), "Transferred %llu bytes in %.1f seconds (%.1f KB/s)",
+                 static_cast<unsigned long long>(bytes), seconds, seconds > 0 ? bytes / seconds / 1024 : 0.0);
+        lines.push_back(progress);
+    }
+    else
+        lines.push_back("No data transfer in progress");
+
+    lines.push_back("End of status");
+    ftpPI->writeCtrlMultiline(SYSTEM_STATUS, lines);
+}
+
+
+/************************************************************
+ * SITECommand class definition
+ ************************************************************/
+void SITECommand::execute(FtpServerPI *ftpPI, const CommandLine &line) {
+    std::string subCommand(line.argument);
+    std::transform(subCommand.begin(), subCommand.end(), subCommand.begin(), ::toupper);
+    if (subCommand != "STATS") {
+        ftpPI->writeCtrl(COMMAND_NOT_IMPLEMENTED_FOR_ARGS, "Only SITE STATS is supported");
+        return;
+    }
+
+    // latencies in microseconds, rates while transferring
+    auto lines = ftpPI->server().metrics().report();
+    lines.insert(lines.begin(), "Server statistics:");
+    lines.push_back("End of statistics");
+    ftpPI->writeCtrlMultiline(SYSTEM_STATUS, lines);
+}
+
+
+/************************************************************
+ * FEATCommand class definition
+ ************************************************************/
+void FEATCommand::execute(FtpServerPI *ftpPI, const CommandLine &) {
+    ftpPI->writeCtrlMultiline(SYSTEM_STATUS, {
+        "Features:",
+        "EPRT",
+        "EPSV",
+        "MLST type*;size*;modify*;perm*;",
+        "REST STREAM",
+        "End"
+    });
+}
+
+
+/************************************************************
+ * MLSTCommand class definition
+ ************************************************************/
+void MLSTCommand::execute(FtpServerPI *ftpPI, const CommandLine &line) {
+
+    std::string userPath = line.hasArgument() ? std::string(line.argument) : "/" + ftpPI->userWorkingDir;
+    FileDescriptor file(ftpPI->openUserPath(line.argument, O_PATH | O_CLOEXEC));
+
+    struct stat fstat;
+    char facts[PATH_MAX + 128];
+    std::size_t len = 0;
+    if (file.isValid() && statFacts(file.get(), "", fstat))
+        len = formatFacts(facts, sizeof(facts), fstat, userPath.c_str(), userPath.size());
+
+    if (len == 0) {
+        ftpPI->writeCtrl(REQUESTED_FILE_ACTION_NOT_TAKEN_FILE_UNAVAILABLE, "Failed to get file status");
+        return;
+    }
+
+    // drop the CRLF, the reply adds its own
+    ftpPI->writeCtrlMultiline(REQUESTED_FILE_ACTION_COMPLETED, {
+        "Listing " + userPath,
+        std::string(facts, len-2),
+        "End"
+    });
+}
+
+
+/************************************************************
+ * MLSDCommand class definition
+ ************************************************************/
+void MLSDCommand::execute(FtpServerPI *ftpPI, const CommandLine &line) {
+    auto &ftpDTP = ftpPI->DTP();
+
+    // get the directory to list
+    FileDescriptor dir(ftpPI->openUserPath(line.argument, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+
+    if (!dir.isValid()) {
+        ftpPI->writeCtrl(REQUESTED_FILE_ACTION_NOT_TAKEN_FILE_UNAVAILABLE, "Failed to open directory");
+        return;
+    }
+
+    // check if data connection setup
+    if (!ftpDTP.doesDataConnectSetup()) {
+        ftpDTP.closeDataConnect();
+        ftpPI->writeCtrl(CANNOT_OPEN_DATA_CONNECTION, "Failed open data connection");
+        return;
+    }
+
+    // open data connection
+    try {
+        ftpDTP.openData();
+    } catch (const SocketException &) {
+        ftpDTP.closeDataConnect();
+        ftpPI->writeCtrl(CANNOT_OPEN_DATA_CONNECTION, "Failed open data connection");
+        return;
+    }
+
+    // write to data connection
+    ftpPI->writeCtrl(FILE_STATUS_OK_OPEN_DATA_CONNECTION, "Here come the directory listing");
+
+    try {
+        // one buffer for the whole listing, sent each time it fills up
+        static const std::size_t LISTING_BUF_MAX = 64 * 1024;
+        auto buf = std::make_unique<char[]>(LISTING_BUF_MAX);
+        auto flush = [&ftpDTP](const char *data, std::size_t size) {
+            ftpDTP.writeData(data, size);
+        };
+
+        if (!listDirectoryFacts(dir.get(), buf.get(), LISTING_BUF_MAX, flush)) {
+            ftpDTP.closeDataConnect();
+            ftpPI->writeCtrl(REQUESTED_ACTION_ABORTED_LOCAL_ERROR_PROCESSING, "Failed to read directory");
+            return;
+        }
+
+        ftpDTP.closeDataConnect();
+        ftpPI->writeCtrl(CLOSE_DATA_CONNECTION_REQUEST_FILE_ACTION_SUCCESS, "Directory listing sent OK");
+
+    } catch (const SocketException &) {
+        ftpDTP.closeDataConnect();
+        ftpPI->writeCtrl(CONNECTION_CLOSE_TRANSFER_ABORT, "Data connection close transfer abort");
+    } catch (const std::exception &) {
+        ftpDTP.closeDataConnect();
+        ftpPI->writeCtrl(REQUESTED_ACTION_ABORTED_LOCAL_ERROR_PROCESSING, "Data connection close local error");
+    }
+}
@@ -1,15 +1,21 @@
 #ifndef FTPSESSION_H
 #define FTPSESSION_H
 
+#include <sys/types.h>
+#include <climits>
+#include <cstdint>
 #include <memory>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <limits>
 #include <functional>
 #include "Socket.h"
 
 
+class FtpServer;
 class FtpServerDTP;
+class TokenBucket;
 
 
 enum TransferMode {
@@ -65,16 +71,26 @@ enum FtpCode {
     // RFC 2428 reply code
     NETWORK_PROTOCOL_NOT_SUPPORTED = 522,
     ENTERING_EXTENDED_PASSIVE_MODE = 229,
+
+    // RFC 3659 reply code
+    INVALID_RESTART_POSITION = 554,
 };
 
 
-void runFtpServer(uint16_t port, const std::string &accountsFile, NetProtocol protocol);
+// A command line split in place. Verb and argument point into the line the
+// session read, so they are only valid while the command runs
+struct CommandLine {
+    std::string_view verb;
+    std::string_view argument;
+
+    bool hasArgument() const { return !argument.empty(); }
+};
 
 
 class FtpServerPI
 {
 public:
-    FtpServerPI(Socket ctrlSock, std::string accountsFile);
+    FtpServerPI(Socket ctrlSock, FtpServer &server);
 
     FtpServerPI(const FtpServerPI &) = delete;
 
@@ -82,16 +98,54 @@ public:
 
     ~FtpServerPI();
 
-    void run();
+    void start();
+
+    void onReadable();
+
+    void onReadableDuringTransfer();
+
+    bool hasPendingTransfer() const;
+
+    void runPendingTransfer();
+
+    void finishPendingTransfer();
+
+    bool abortTransfer();
+
+    bool closed() const;
 
-    void writeCtrl(FtpCode code, const std::string &reply);
+    void writeCtrl(FtpCode code, std::string_view reply);
+
+    void writeCtrlMultiline(FtpCode code, const std::vector<std::string> &lines);
+
+    // sends the replies the socket had no room for, true while some are left
+    bool flushCtrl();
+
+    bool hasPendingOutput() const;
 
     void closeCtrl();
 
-    const std::string &accountsFile() const;
+    FtpServer &server();
 
     std::string serverIPAddr() const;
 
+    // writes the path of a file the user names, inside the home directory, to
+    // nativePath. False, with nativePath empty, when it does not fit
+    bool convertToNativePath(std::string_view userPath, char (&nativePath)[PATH_MAX]) const;
+
+    // opens the home directory after login and makes it the working directory
+    bool openHomeDir(const std::string &nativeHomeDir);
+
+    bool changeWorkingDir(std::string_view userPath);
+
+    // opens a file the user names with open(2) flags. The kernel resolves it from
+    // the working directory and does not let it leave the home directory.
+    // -1 with errno set on failure
+    int openUserPath(std::string_view userPath, int flags, mode_t mode = 0) const;
+
+    // identifies the session in the log
+    uint64_t sessionId() const;
+
     FtpServerDTP &DTP();
 
     std::string username;
@@ -101,6 +155,12 @@ public:
     bool        loggedIn;
     bool        quit;
 
+    // byte offset set by REST for the next RETR or STOR
+    uint64_t    restartOffset;
+
+    // bytes announced by ALLO for the next STOR
+    uint64_t    allocSize;
+
     // 5 minutes timeout for each user session
     static const int TIME_OUT = 5 * 60 * 1000;
 
@@ -112,7 +172,7 @@ private:
 
 class FtpServerDTP {
 public:
-    FtpServerDTP();
+    FtpServerDTP(FtpServer &server, uint64_t sessionId);
 
     ~FtpServerDTP();
 
@@ -126,19 +186,34 @@ public:
                          uint16_t port,
                          NetProtocol protocol);
 
-    void setupPassiveMode(uint16_t port, NetProtocol protocol);
+    uint16_t setupPassiveMode(NetProtocol protocol);
 
     void closeDataConnect();
 
     void openData();
 
+    void setUserRateLimit(std::shared_ptr<TokenBucket> limit);
+
+    void resetAbort();
+
+    void abort();
+
+    bool transferProgress(uint64_t &bytes, double &seconds) const;
+
     void writeData(std::istream &data);
 
-    void readData(std::ostream &data);
+    void writeFile(int fd, off_t offset);
 
-    static const uint16_t USABLE_PORT_MIN  = 1024;
+    void writeData(const char *data, std::size_t size);
 
-    static const uint16_t USABLE_PORT_MAX  = std::numeric_limits<uint16_t>::max();
+    void readData(int fd, off_t offset);
+
+    // ports that fail to bind are skipped, up to this many per PASV
+    static const int PASSIVE_BIND_ATTEMPTS = 16;
+
+    // how long the data connection may take to open before the transfer gives
+    // up its worker with 425
+    static const int CONNECT_TIME_OUT = 30 * 1000;
 
 private:
     struct Impl;
@@ -146,190 +221,227 @@ private:
 };
 
 
-class FtpCommand {
-public:
-    FtpCommand(FtpServerPI *PI);
+// Entry of the static dispatch table. Commands keep no state of their own, their
+// handlers work on the session they are given, so sessions share one table and
+// allocate nothing for it.
+struct FtpCommand {
+    using Handler = void (*)(FtpServerPI *ftpPI, const CommandLine &line);
 
-    virtual ~FtpCommand();
+    enum Flags : uint8_t {
+        NEEDS_LOGIN          = 1,
+        TRANSFERS_DATA       = 2,
+        RUNS_DURING_TRANSFER = 4,
+    };
 
-    virtual void execute(const std::vector<std::string> &args) = 0;
+    const char *name;
+    Handler     handler;
+    uint8_t     flags;
 
-    FtpServerPI *PI();
+    bool needsLogin() const { return flags & NEEDS_LOGIN; }
 
-    std::string convertToNativePath(const std::string &userPath);
+    bool transfersData() const { return flags & TRANSFERS_DATA; }
 
-private:
-    struct Impl;
-    std::unique_ptr<Impl> _impl;
-};
+    bool runsDuringTransfer() const { return flags & RUNS_DURING_TRANSFER; }
 
+    // position in the table, also the id of the command in the server metrics
+    int id() const;
 
-class TYPECommand : public FtpCommand {
-public:
-    TYPECommand(FtpServerPI *session)
-        : FtpCommand{session}
-    {}
+    // executes the command and records how long it took
+    void run(FtpServerPI *ftpPI, const CommandLine &line) const;
 
-    void execute(const std::vector<std::string> &args) override;
+    // the command for a verb in any case, nullptr if there is none
+    static const FtpCommand *find(std::string_view verb);
 
-    static const std::string PROG;
-};
+    static int count();
 
+    static const FtpCommand &byId(int id);
+};
 
 
-class USERCommand : public FtpCommand {
+class TYPECommand {
 public:
-    USERCommand(FtpServerPI *session)
-        : FtpCommand{session}
-    {}
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
 
-    void execute(const std::vector<std::string> &args) override;
-
-    static const std::string PROG;
+    static constexpr const char *PROG = "TYPE";
 };
 
 
-class PASSCommand : public FtpCommand {
+class USERCommand {
 public:
-    PASSCommand(FtpServerPI *session)
-        : FtpCommand{session}
-    {}
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
+
+    static constexpr const char *PROG = "USER";
+};
+
 
-    void execute(const std::vector<std::string> &args) override;
+class PASSCommand {
+public:
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
 
-    static const std::string PROG;
+    static constexpr const char *PROG = "PASS";
 };
 
 
-class PWDCommand : public FtpCommand {
+class PWDCommand {
 public:
-    PWDCommand(FtpServerPI *session)
-        : FtpCommand{session}
-    {}
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
+
+    static constexpr const char *PROG = "PWD";
+};
 
-    void execute(const std::vector<std::string> &args) override;
 
-    static const std::string PROG;
+class CWDCommand {
+public:
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
+
+    static constexpr const char *PROG = "CWD";
 };
 
 
-class CWDCommand : public FtpCommand {
+class CDUPCommand {
 public:
-    CWDCommand(FtpServerPI *session)
-        : FtpCommand{session}
-    {}
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
+
+    static constexpr const char *PROG = "CDUP";
+};
 
-    void execute(const std::vector<std::string> &args) override;
 
-    static const std::string PROG;
+class QUITCommand {
+public:
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
+
+    static constexpr const char *PROG = "QUIT";
 };
 
 
-class CDUPCommand : public FtpCommand {
+class PORTCommand {
 public:
-    CDUPCommand(FtpServerPI *session)
-        : FtpCommand{session}
-    {}
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
 
-    void execute(const std::vector<std::string> &args) override;
+    static constexpr const char *PROG = "PORT";
+};
 
-    static const std::string PROG;
+
+class EPRTCommand {
+public:
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
+
+    static constexpr const char *PROG = "EPRT";
 };
 
 
-class QUITCommand : public FtpCommand {
+class PASVCommand {
 public:
-    QUITCommand(FtpServerPI *session)
-        : FtpCommand{session}
-    {}
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
+
+    static constexpr const char *PROG = "PASV";
+};
 
-    void execute(const std::vector<std::string> &args) override;
 
-    static const std::string PROG;
+class EPSVCommand {
+public:
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
+
+    static constexpr const char *PROG = "EPSV";
 };
 
 
-class PORTCommand : public FtpCommand {
+class LISTCommand {
 public:
-    PORTCommand(FtpServerPI *session)
-        : FtpCommand{session}
-    {}
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
+
+    static constexpr const char *PROG = "LIST";
+};
 
-    void execute(const std::vector<std::string> &args) override;
 
-    static const std::string PROG;
+class RETRCommand {
+public:
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
+
+    static constexpr const char *PROG = "RETR";
 };
 
 
-class EPRTCommand : public FtpCommand {
+class STORCommand {
 public:
-    EPRTCommand(FtpServerPI *session)
-        : FtpCommand{session}
-    {}
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
 
-    void execute(const std::vector<std::string> &args) override;
+    static constexpr const char *PROG = "STOR";
 
-    static const std::string PROG;
+protected:
+    static void store(FtpServerPI *ftpPI, const CommandLine &line, bool append);
 };
 
 
-class PASVCommand : public FtpCommand {
+class APPECommand : public STORCommand {
 public:
-    PASVCommand(FtpServerPI *session)
-        : FtpCommand{session}
-    {}
-
-    void execute(const std::vector<std::string> &args) override;
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
 
-    static const std::string PROG;
+    static constexpr const char *PROG = "APPE";
 };
 
 
-class EPSVCommand : public FtpCommand {
+class ALLOCommand {
 public:
-    EPSVCommand(FtpServerPI *session)
-        : FtpCommand{session}
-    {}
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
+
+    static constexpr const char *PROG = "ALLO";
+};
 
-    void execute(const std::vector<std::string> &args) override;
 
-    static const std::string PROG;
+class RESTCommand {
+public:
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
+
+    static constexpr const char *PROG = "REST";
 };
 
 
-class LISTCommand : public FtpCommand {
+class ABORCommand {
 public:
-    LISTCommand(FtpServerPI *session)
-        : FtpCommand{session}
-    {}
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
 
-    void execute(const std::vector<std::string> &args) override;
+    static constexpr const char *PROG = "ABOR";
+};
 
-    static const std::string PROG;
+
+class STATCommand {
+public:
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
+
+    static constexpr const char *PROG = "STAT";
 };
 
 
-class RETRCommand : public FtpCommand {
+class SITECommand {
 public:
-    RETRCommand(FtpServerPI *session)
-        : FtpCommand{session}
-    {}
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
+
+    static constexpr const char *PROG = "SITE";
+};
 
-    void execute(const std::vector<std::string> &args) override;
 
-    static const std::string PROG;
+class FEATCommand {
+public:
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
+
+    static constexpr const char *PROG = "FEAT";
 };
 
 
-class STORCommand : public FtpCommand {
+class MLSTCommand {
 public:
-    STORCommand(FtpServerPI *session)
-        : FtpCommand{session}
-    {}
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
 
-    void execute(const std::vector<std::string> &args) override;
+    static constexpr const char *PROG = "MLST";
+};
+
+
+class MLSDCommand {
+public:
+    static void execute(FtpServerPI *ftpPI, const CommandLine &line);
 
-    static const std::string PROG;
+    static constexpr const char *PROG = "MLSD";
 };
 
 #endif // FTPSESSION_H
@@ -0,0 +1,451 @@
+#include <algorithm>
+#include <cerrno>
+#include <memory>
+#include "IoUring.h"
+#include "Socket.h"
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cstring>
+
+
+static int ioUringSetup(unsigned entries, io_uring_params *params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+
+static int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+}
+
+
+static int ioUringRegister(int fd, unsigned opcode, const void *arg, unsigned args) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, args));
+}
+
+
+/************************************************************
+ * Ring class definition
+ ************************************************************/
+class Ring {
+public:
+    Ring(unsigned entries, std::size_t bufSize)
+        : _bufSize{bufSize}
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        _ringfd = ioUringSetup(entries, &params);
+        if (_ringfd == -1)
+            throw SocketException();
+
+        // map the submission and completion rings, they share one mapping on newer kernels
+        _sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        _cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            _sqRingSize = _cqRingSize = std::max(_sqRingSize, _cqRingSize);
+
+        _sqRing = mmap(nullptr, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_SQ_RING);
+        _cqRing = params.features & IORING_FEAT_SINGLE_MMAP ?
+                  _sqRing :
+                  mmap(nullptr, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_CQ_RING);
+        _sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        _sqes = static_cast<io_uring_sqe *>(mmap(nullptr, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_SQES));
+        if (_sqRing == MAP_FAILED || _cqRing == MAP_FAILED || _sqes == MAP_FAILED) {
+            int err = errno;
+            release();
+            errno = err;
+            throw SocketException();
+        }
+
+        auto sq = static_cast<char *>(_sqRing);
+        _sqTail  = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        _sqMask  = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        _sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+
+        auto cq = static_cast<char *>(_cqRing);
+        _cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        _cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        _cqMask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        _cqes   = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+        // pin the transfer buffers once, the kernel then skips mapping them on every operation
+        for (auto &buffer : _buffers)
+            buffer = std::make_unique<Byte[]>(bufSize);
+
+        iovec iov[2] = { { _buffers[0].get(), bufSize }, { _buffers[1].get(), bufSize } };
+        _fixedBuffers = ioUringRegister(_ringfd, IORING_REGISTER_BUFFERS, iov, 2) == 0;
+    }
+
+
+    Ring(const Ring &) = delete;
+
+
+    Ring &operator=(const Ring &) = delete;
+
+
+    ~Ring() {
+        release();
+    }
+
+
+    std::size_t bufSize() const {
+        return _bufSize;
+    }
+
+
+    Byte *buffer(int i) {
+        return _buffers[i].get();
+    }
+
+
+    void prepRead(int fd, int buf, std::size_t offset, std::size_t len, off_t fileOffset, uint8_t flags, uint64_t tag) {
+        auto sqe = nextSqe();
+        sqe->opcode    = _fixedBuffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd        = fd;
+        sqe->addr      = reinterpret_cast<uint64_t>(buffer(buf) + offset);
+        sqe->len       = static_cast<uint32_t>(len);
+        sqe->off       = static_cast<uint64_t>(fileOffset);
+        sqe->buf_index = static_cast<uint16_t>(buf);
+        sqe->flags     = flags;
+        sqe->user_data = tag;
+    }
+
+
+    void prepWrite(int fd, int buf, std::size_t offset, std::size_t len, off_t fileOffset, uint64_t tag) {
+        auto sqe = nextSqe();
+        sqe->opcode    = _fixedBuffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd        = fd;
+        sqe->addr      = reinterpret_cast<uint64_t>(buffer(buf) + offset);
+        sqe->len       = static_cast<uint32_t>(len);
+        sqe->off       = static_cast<uint64_t>(fileOffset);
+        sqe->buf_index = static_cast<uint16_t>(buf);
+        sqe->user_data = tag;
+    }
+
+
+    void prepSend(int sockfd, int buf, std::size_t offset, std::size_t len, uint64_t tag) {
+        auto sqe = nextSqe();
+        sqe->opcode    = IORING_OP_SEND;
+        sqe->fd        = sockfd;
+        sqe->addr      = reinterpret_cast<uint64_t>(buffer(buf) + offset);
+        sqe->len       = static_cast<uint32_t>(len);
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data = tag;
+    }
+
+
+    void prepRecv(int sockfd, int buf, std::size_t len, uint64_t tag) {
+        auto sqe = nextSqe();
+        sqe->opcode    = IORING_OP_RECV;
+        sqe->fd        = sockfd;
+        sqe->addr      = reinterpret_cast<uint64_t>(buffer(buf));
+        sqe->len       = static_cast<uint32_t>(len);
+        sqe->msg_flags = MSG_WAITALL;
+        sqe->user_data = tag;
+    }
+
+
+    // submits everything prepared and waits for all of it to complete. A ring the
+    // kernel refused is left broken, what it has in flight is unknown
+    void submitAndWait(unsigned count) {
+        __atomic_store_n(_sqTail, _pendingTail, __ATOMIC_RELEASE);
+        unsigned toSubmit = count;
+        while (true) {
+            int res = ioUringEnter(_ringfd, toSubmit, count, IORING_ENTER_GETEVENTS);
+            if (res >= 0)
+                break;
+
+            if (errno != EINTR) {
+                _broken = true;
+                throw SocketException();
+            }
+
+            toSubmit = 0;
+        }
+    }
+
+
+    bool broken() const {
+        return _broken;
+    }
+
+
+    bool popCompletion(io_uring_cqe &cqe) {
+        unsigned head = *_cqHead;
+        if (head == __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE))
+            return false;
+
+        cqe = _cqes[head & _cqMask];
+        __atomic_store_n(_cqHead, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+private:
+    io_uring_sqe *nextSqe() {
+        unsigned index = _pendingTail & _sqMask;
+        io_uring_sqe *sqe = &_sqes[index];
+        memset(sqe, 0, sizeof(io_uring_sqe));
+        _sqArray[index] = index;
+        ++_pendingTail;
+        return sqe;
+    }
+
+
+    void release() {
+        if (_sqes != nullptr && _sqes != MAP_FAILED)
+            munmap(_sqes, _sqesSize);
+
+        if (_cqRing != nullptr && _cqRing != MAP_FAILED && _cqRing != _sqRing)
+            munmap(_cqRing, _cqRingSize);
+
+        if (_sqRing != nullptr && _sqRing != MAP_FAILED)
+            munmap(_sqRing, _sqRingSize);
+
+        close(_ringfd);
+    }
+
+
+    std::size_t _bufSize;
+    int _ringfd = -1;
+    void *_sqRing = nullptr;
+    void *_cqRing = nullptr;
+    io_uring_sqe *_sqes = nullptr;
+    std::size_t _sqRingSize = 0;
+    std::size_t _cqRingSize = 0;
+    std::size_t _sqesSize = 0;
+    unsigned *_sqTail = nullptr;
+    unsigned *_sqArray = nullptr;
+    unsigned _sqMask = 0;
+    unsigned _pendingTail = 0;
+    unsigned *_cqHead = nullptr;
+    unsigned *_cqTail = nullptr;
+    unsigned _cqMask = 0;
+    io_uring_cqe *_cqes = nullptr;
+    std::unique_ptr<Byte[]> _buffers[2];
+    bool _fixedBuffers = false;
+    bool _broken = false;
+};
+
+
+static const unsigned RING_ENTRIES = 8;
+
+enum Tag : uint64_t {
+    TAG_DISK = 1,
+    TAG_SOCKET = 2,
+};
+
+
+static Ring &threadRing(std::size_t bufSize) {
+    // transfers on a worker thread run one at a time, so they can share its ring
+    static thread_local std::unique_ptr<Ring> ring;
+    if (!ring || ring->bufSize() != bufSize || ring->broken()) {
+        ring.reset();
+        ring = std::make_unique<Ring>(RING_ENTRIES, bufSize);
+    }
+
+    return *ring;
+}
+
+
+// keeps the first failure of a batch. The rest of the batch is still reaped so
+// that none of its completions are left in the ring for the next transfer
+static bool failed(int32_t res, int32_t &error) {
+    if (res < 0 && error == 0)
+        error = res;
+
+    return res < 0;
+}
+
+
+static void checkResult(int32_t error) {
+    if (error < 0) {
+        errno = -error;
+        throw SocketException();
+    }
+}
+
+
+bool ioUringSupported() {
+    static const bool supported = []() {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        int fd = ioUringSetup(RING_ENTRIES, &params);
+        if (fd == -1)
+            return false;
+
+        static const int OPS_MAX = 256;
+        auto probe = std::make_unique<Byte[]>(sizeof(io_uring_probe) + OPS_MAX * sizeof(io_uring_probe_op));
+        memset(probe.get(), 0, sizeof(io_uring_probe) + OPS_MAX * sizeof(io_uring_probe_op));
+        auto ops = reinterpret_cast<io_uring_probe *>(probe.get());
+        bool res = ioUringRegister(fd, IORING_REGISTER_PROBE, ops, OPS_MAX) == 0;
+        for (int op : { IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_READ,
+                        IORING_OP_WRITE, IORING_OP_SEND, IORING_OP_RECV })
+        {
+            res = res && op <= ops->last_op && (ops->ops[op].flags & IO_URING_OP_SUPPORTED);
+        }
+
+        close(fd);
+        return res;
+    }();
+
+    return supported;
+}
+
+
+std::size_t ioUringSendFile(int sockfd, int fileFd, off_t offset, std::size_t size, std::size_t bufSize,
+                            const TransferProgress &progress)
+{
+    Ring &ring = threadRing(bufSize);
+    if (size == 0)
+        return 0;
+
+    // the first buffer is sent straight after it is read by linking the two
+    int curr = 0;
+    std::size_t readSoFar = std::min(bufSize, size);
+    ring.prepRead(fileFd, curr, 0, readSoFar, offset, IOSQE_IO_LINK, TAG_DISK);
+    ring.prepSend(sockfd, curr, 0, readSoFar, TAG_SOCKET);
+    ring.submitAndWait(2);
+
+    std::size_t currLen = 0, currSent = 0, nextLen = 0, sentSoFar = 0;
+    int32_t error = 0;
+    io_uring_cqe cqe;
+    while (ring.popCompletion(cqe)) {
+        if (cqe.user_data == TAG_DISK) {
+            if (!failed(cqe.res, error))
+                currLen = readSoFar = static_cast<std::size_t>(cqe.res);
+        }
+        else if (cqe.res != -ECANCELED && !failed(cqe.res, error)) {
+            // a short read cancels the send, what was read is sent below
+            currSent = sentSoFar = static_cast<std::size_t>(cqe.res);
+            progress(currSent);
+        }
+    }
+
+    checkResult(error);
+
+    bool eof = readSoFar == 0;
+    while (currSent < currLen || (!eof && readSoFar < size)) {
+        // only one send in flight so the data leaves in order, the read of the other buffer overlaps it
+        unsigned count = 0;
+        if (currSent < currLen) {
+            ring.prepSend(sockfd, curr, currSent, currLen - currSent, TAG_SOCKET);
+            ++count;
+        }
+
+        if (!eof && readSoFar < size && nextLen == 0) {
+            ring.prepRead(fileFd, 1 - curr, 0, std::min(bufSize, size - readSoFar),
+                          offset + static_cast<off_t>(readSoFar), 0, TAG_DISK);
+            ++count;
+        }
+
+        ring.submitAndWait(count);
+        while (ring.popCompletion(cqe)) {
+            if (failed(cqe.res, error))
+                continue;
+
+            if (cqe.user_data == TAG_DISK) {
+                nextLen = static_cast<std::size_t>(cqe.res);
+                readSoFar += nextLen;
+                eof = nextLen == 0;
+            }
+            else {
+                currSent += static_cast<std::size_t>(cqe.res);
+                sentSoFar += static_cast<std::size_t>(cqe.res);
+                progress(static_cast<std::size_t>(cqe.res));
+            }
+        }
+
+        checkResult(error);
+        if (currSent == currLen) {
+            curr = 1 - curr;
+            currLen = nextLen;
+            currSent = 0;
+            nextLen = 0;
+        }
+    }
+
+    return sentSoFar;
+}
+
+
+std::size_t ioUringRecvFile(int sockfd, int fileFd, off_t offset, std::size_t bufSize,
+                            const TransferProgress &progress)
+{
+    Ring &ring = threadRing(bufSize);
+
+    // receive into one buffer while the one received before is written
+    int curr = 0;
+    std::size_t currLen = 0, prevLen = 0, prevWritten = 0, writtenSoFar = 0;
+    bool eof = false;
+    while (!eof || prevWritten < prevLen) {
+        unsigned count = 0;
+        if (prevWritten < prevLen) {
+            ring.prepWrite(fileFd, 1 - curr, prevWritten, prevLen - prevWritten,
+                           offset + static_cast<off_t>(writtenSoFar), TAG_DISK);
+            ++count;
+        }
+
+        // after a short write the received buffer waits until the other one is written
+        if (!eof && currLen == 0) {
+            ring.prepRecv(sockfd, curr, bufSize, TAG_SOCKET);
+            ++count;
+        }
+
+        ring.submitAndWait(count);
+        io_uring_cqe cqe;
+        int32_t error = 0;
+        while (ring.popCompletion(cqe)) {
+            if (failed(cqe.res, error))
+                continue;
+
+            if (cqe.user_data == TAG_DISK) {
+                prevWritten += static_cast<std::size_t>(cqe.res);
+                writtenSoFar += static_cast<std::size_t>(cqe.res);
+            }
+            else {
+                currLen = static_cast<std::size_t>(cqe.res);
+                eof = currLen == 0;
+                progress(currLen);
+            }
+        }
+
+        checkResult(error);
+        if (prevWritten == prevLen) {
+            curr = 1 - curr;
+            prevLen = currLen;
+            prevWritten = 0;
+            currLen = 0;
+        }
+    }
+
+    return writtenSoFar;
+}
+
+
+#else
+
+
+bool ioUringSupported() {
+    return false;
+}
+
+
+std::size_t ioUringSendFile(int, int, off_t, std::size_t, std::size_t, const TransferProgress &) {
+    errno = ENOSYS;
+    throw SocketException();
+}
+
+
+std::size_t ioUringRecvFile(int, int, off_t, std::size_t, const TransferProgress &) {
+    errno = ENOSYS;
+    throw SocketException();
+}
+
+
+#endif // HAVE_IO_URING
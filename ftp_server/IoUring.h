@@ -0,0 +1,33 @@
+#ifndef IOURING_H
+#define IOURING_H
+
+#include <sys/types.h>
+#include <cstddef>
+#include <functional>
+
+
+// Optional io_uring engine for data channel transfers. Every thread gets its
+// own ring with two registered buffers. Each step submits the disk operation
+// on one buffer together with the socket operation on the other, so a single
+// io_uring_enter both moves a buffer over the network and refills or flushes
+// the other one. Both transfer functions throw SocketException on failure.
+
+// true if the kernel supports every operation the engine needs
+bool ioUringSupported();
+
+
+// progress is told every time bytes leave or arrive on the socket
+using TransferProgress = std::function<void(std::size_t)>;
+
+
+// sends size bytes of fileFd starting at offset, returns the bytes sent
+std::size_t ioUringSendFile(int sockfd, int fileFd, off_t offset, std::size_t size, std::size_t bufSize,
+                            const TransferProgress &progress);
+
+
+// receives until the peer closes, writing to fileFd from offset, returns the bytes written
+std::size_t ioUringRecvFile(int sockfd, int fileFd, off_t offset, std::size_t bufSize,
+                            const TransferProgress &progress);
+
+
+#endif // IOURING_H
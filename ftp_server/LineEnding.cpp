@@ -0,0 +1,207 @@
+#include <cstring>
+#include "LineEnding.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LINE_ENDING_X86
+#include <immintrin.h>
+#endif
+
+
+// Copies the bytes up to each LF and puts a CR in front of the LF unless
+// there already is one. Offsets of the LFs come from the scanner.
+class CrlfWriter {
+public:
+    static const char TARGET = '\n';
+
+    CrlfWriter(const char *in, char *out, bool lastWasCr)
+        : _in{in}
+        , _out{out}
+        , _lastWasCr{lastWasCr}
+    {}
+
+
+    void found(std::size_t pos) {
+        std::memcpy(_out, _in + _copied, pos - _copied);
+        _out += pos - _copied;
+
+        bool hasCr = pos > 0 ? _in[pos - 1] == '\r' : _lastWasCr;
+        if (!hasCr)
+            *_out++ = '\r';
+
+        *_out++ = '\n';
+        _copied = pos + 1;
+    }
+
+
+    char *finish(std::size_t size) {
+        std::memcpy(_out, _in + _copied, size - _copied);
+        return _out + (size - _copied);
+    }
+
+private:
+    const char *_in;
+    char *_out;
+    std::size_t _copied = 0;
+    bool _lastWasCr;
+};
+
+
+// Copies the bytes up to each CR and drops the CR if an LF follows. A CR
+// ending the block is left out for the caller to hold back. Output never runs
+// ahead of input, so the two may overlap.
+class LfWriter {
+public:
+    static const char TARGET = '\r';
+
+    LfWriter(const char *in, char *out, std::size_t size)
+        : _in{in}
+        , _out{out}
+        , _size{size}
+    {}
+
+
+    void found(std::size_t pos) {
+        std::memmove(_out, _in + _copied, pos - _copied);
+        _out += pos - _copied;
+        _copied = pos + 1;
+
+        if (pos + 1 < _size && _in[pos + 1] != '\n')
+            *_out++ = '\r';
+    }
+
+
+    char *finish(std::size_t size) {
+        std::memmove(_out, _in + _copied, size - _copied);
+        return _out + (size - _copied);
+    }
+
+private:
+    const char *_in;
+    char *_out;
+    std::size_t _size;
+    std::size_t _copied = 0;
+};
+
+
+template<typename Writer>
+static void scanScalar(const char *in, std::size_t begin, std::size_t size, Writer &writer) {
+    const char *pos = in + begin;
+    const char *end = in + size;
+    while ((pos = static_cast<const char *>(std::memchr(pos, Writer::TARGET, static_cast<std::size_t>(end - pos)))) != nullptr) {
+        writer.found(static_cast<std::size_t>(pos - in));
+        ++pos;
+    }
+}
+
+
+#ifdef LINE_ENDING_X86
+
+template<typename Writer>
+static void emitMask(unsigned mask, std::size_t base, Writer &writer) {
+    while (mask != 0) {
+        writer.found(base + static_cast<std::size_t>(__builtin_ctz(mask)));
+        mask &= mask - 1;
+    }
+}
+
+
+template<typename Writer>
+__attribute__((target("sse2")))
+static void scanSse2(const char *in, std::size_t size, Writer &writer) {
+    const __m128i target = _mm_set1_epi8(Writer::TARGET);
+    std::size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+        auto mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(block, target)));
+        emitMask(mask, i, writer);
+    }
+
+    scanScalar(in, i, size, writer);
+}
+
+
+template<typename Writer>
+__attribute__((target("avx2")))
+static void scanAvx2(const char *in, std::size_t size, Writer &writer) {
+    const __m256i target = _mm256_set1_epi8(Writer::TARGET);
+    std::size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+        auto mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, target)));
+        emitMask(mask, i, writer);
+    }
+
+    scanScalar(in, i, size, writer);
+}
+
+#endif // LINE_ENDING_X86
+
+
+template<typename Writer>
+static void scanAny(const char *in, std::size_t size, Writer &writer) {
+    scanScalar(in, 0, size, writer);
+}
+
+
+template<typename Writer>
+using Scanner = void (*)(const char *, std::size_t, Writer &);
+
+
+template<typename Writer>
+static Scanner<Writer> selectScanner() {
+#ifdef LINE_ENDING_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return scanAvx2<Writer>;
+
+    if (__builtin_cpu_supports("sse2"))
+        return scanSse2<Writer>;
+#endif
+
+    return scanAny<Writer>;
+}
+
+
+/************************************************************
+ * LfToCrlf class definition
+ ************************************************************/
+std::size_t LfToCrlf::convert(const char *in, std::size_t size, char *out) {
+    static const Scanner<CrlfWriter> scan = selectScanner<CrlfWriter>();
+    if (size == 0)
+        return 0;
+
+    CrlfWriter writer(in, out, _lastWasCr);
+    scan(in, size, writer);
+    _lastWasCr = in[size - 1] == '\r';
+    return static_cast<std::size_t>(writer.finish(size) - out);
+}
+
+
+/************************************************************
+ * CrlfToLf class definition
+ ************************************************************/
+std::size_t CrlfToLf::convert(const char *in, std::size_t size, char *out) {
+    static const Scanner<LfWriter> scan = selectScanner<LfWriter>();
+    if (size == 0)
+        return 0;
+
+    // the CR held back is dropped if this block starts with its LF
+    char *begin = out;
+    if (_heldCr && in[0] != '\n')
+        *out++ = '\r';
+
+    _heldCr = in[size - 1] == '\r';
+    LfWriter writer(in, out, size);
+    scan(in, size, writer);
+    return static_cast<std::size_t>(writer.finish(size) - begin);
+}
+
+
+std::size_t CrlfToLf::finish(char *out) {
+    if (!_heldCr)
+        return 0;
+
+    _heldCr = false;
+    *out = '\r';
+    return 1;
+}
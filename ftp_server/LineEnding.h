@@ -0,0 +1,44 @@
+#ifndef LINEENDING_H
+#define LINEENDING_H
+
+#include <cstddef>
+
+
+// Converts the bare LF line endings of a stream to the CRLF that TYPE A
+// requires, a block at a time. A CR directly before an LF is kept as it is,
+// also when the two end up in different blocks, so text that already uses
+// CRLF passes through unchanged. LFs are searched 16 or 32 bytes at a time
+// when the CPU has SSE2 or AVX2 and byte by byte otherwise.
+class LfToCrlf {
+public:
+    // converts size bytes of in into out, which must hold 2 * size bytes.
+    // Returns the length written.
+    std::size_t convert(const char *in, std::size_t size, char *out);
+
+private:
+    bool _lastWasCr = false;
+};
+
+
+// Converts the CRLF line endings of a TYPE A stream back to LF. A CR ending
+// one block is held back until the next block shows whether an LF follows,
+// so pairs split between two network reads are still joined. CRs are
+// searched the same way LfToCrlf searches LFs.
+class CrlfToLf {
+public:
+    // converts size bytes of in into out, which must hold size + 1 bytes. For
+    // converting a buffer in place out may be at most in - 1, the byte before
+    // the input takes the CR held back from the last block. Returns the length
+    // written.
+    std::size_t convert(const char *in, std::size_t size, char *out);
+
+    // writes the CR held back from the last block, if any, once the stream
+    // has ended. Returns the length written.
+    std::size_t finish(char *out);
+
+private:
+    bool _heldCr = false;
+};
+
+
+#endif // LINEENDING_H
@@ -0,0 +1,135 @@
+#include <sys/inotify.h>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include "ListingCache.h"
+#include "FileWatcher.h"
+#include "Utility.h"
+
+
+/************************************************************
+ * ListingCache class definition
+ ************************************************************/
+struct ListingCache::Impl {
+    struct Entry {
+        std::shared_ptr<const std::string> listing;
+        timespec mtime;
+        timespec ctime;
+        int watchId;
+        std::list<std::string>::iterator lruPos;
+    };
+
+
+    static std::string key(const std::string &nativeDir) {
+        return "/" + normalizePath(nativeDir);
+    }
+
+
+    static bool sameTime(const timespec &a, const timespec &b) {
+        return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+    }
+
+
+    static std::size_t cost(const std::string &path, const Entry &entry) {
+        return path.size() + entry.listing->size();
+    }
+
+
+    // must hold mutex
+    void erase(std::unordered_map<std::string, Entry>::iterator entry) {
+        watcher->removeWatch(entry->second.watchId);
+        usedBytes -= cost(entry->first, entry->second);
+        lru.erase(entry->second.lruPos);
+        entries.erase(entry);
+    }
+
+
+    std::size_t maxBytes;
+    std::size_t usedBytes;
+    FileWatcher *watcher;
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> entries;
+
+    // most recently used at the front
+    std::list<std::string> lru;
+};
+
+
+ListingCache::ListingCache(std::size_t maxBytes, FileWatcher &watcher) {
+    _impl = std::make_unique<Impl>();
+    _impl->maxBytes  = maxBytes;
+    _impl->usedBytes = 0;
+    _impl->watcher   = &watcher;
+}
+
+
+ListingCache::~ListingCache() {
+    std::lock_guard<std::mutex> guard(_impl->mutex);
+    while (!_impl->entries.empty())
+        _impl->erase(_impl->entries.begin());
+}
+
+
+std::shared_ptr<const std::string> ListingCache::find(const std::string &nativeDir, const struct stat &dirStat) {
+    std::string path = Impl::key(nativeDir);
+
+    std::lock_guard<std::mutex> guard(_impl->mutex);
+    auto entry = _impl->entries.find(path);
+    if (entry == _impl->entries.end())
+        return nullptr;
+
+    if (!Impl::sameTime(entry->second.mtime, dirStat.st_mtim) ||
+        !Impl::sameTime(entry->second.ctime, dirStat.st_ctim))
+    {
+        _impl->erase(entry);
+        return nullptr;
+    }
+
+    _impl->lru.splice(_impl->lru.begin(), _impl->lru, entry->second.lruPos);
+    return entry->second.listing;
+}
+
+
+void ListingCache::insert(const std::string &nativeDir, const struct stat &dirStat, std::string listing) {
+    std::string path = Impl::key(nativeDir);
+    if (path.size() + listing.size() > _impl->maxBytes)
+        return;
+
+    std::lock_guard<std::mutex> guard(_impl->mutex);
+    auto old = _impl->entries.find(path);
+    if (old != _impl->entries.end())
+        _impl->erase(old);
+
+    // any change to the directory or the files in it makes the listing stale
+    static const uint32_t MASK = IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                                 IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+    int watchId = _impl->watcher->addWatch(path, MASK, [this, path](uint32_t, const std::string &) {
+        invalidate(path);
+    });
+
+    // without a watch, changes to files inside the directory would go unnoticed
+    if (watchId == -1)
+        return;
+
+    Impl::Entry entry;
+    entry.listing = std::make_shared<const std::string>(std::move(listing));
+    entry.mtime   = dirStat.st_mtim;
+    entry.ctime   = dirStat.st_ctim;
+    entry.watchId = watchId;
+    entry.lruPos  = _impl->lru.insert(_impl->lru.begin(), path);
+    _impl->usedBytes += Impl::cost(path, entry);
+    _impl->entries.insert({path, std::move(entry)});
+
+    while (_impl->usedBytes > _impl->maxBytes)
+        _impl->erase(_impl->entries.find(_impl->lru.back()));
+}
+
+
+void ListingCache::invalidate(const std::string &nativeDir) {
+    std::string path = Impl::key(nativeDir);
+
+    std::lock_guard<std::mutex> guard(_impl->mutex);
+    auto entry = _impl->entries.find(path);
+    if (entry != _impl->entries.end())
+        _impl->erase(entry);
+}
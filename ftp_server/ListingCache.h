@@ -0,0 +1,38 @@
+#ifndef LISTINGCACHE_H
+#define LISTINGCACHE_H
+
+#include <sys/stat.h>
+#include <memory>
+#include <string>
+
+
+class FileWatcher;
+
+
+// Size bounded LRU cache of rendered directory listings shared by every
+// session. An entry is only served while the directory's mtime and ctime
+// match the ones it was rendered with, and it is dropped as soon as inotify
+// reports a change inside the directory, or the server changes it.
+class ListingCache {
+public:
+    ListingCache(std::size_t maxBytes, FileWatcher &watcher);
+
+    ListingCache(const ListingCache &) = delete;
+
+    ListingCache &operator=(const ListingCache &) = delete;
+
+    ~ListingCache();
+
+    std::shared_ptr<const std::string> find(const std::string &nativeDir, const struct stat &dirStat);
+
+    void insert(const std::string &nativeDir, const struct stat &dirStat, std::string listing);
+
+    void invalidate(const std::string &nativeDir);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+
+#endif // LISTINGCACHE_H
@@ -0,0 +1,265 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Logger.h"
+
+// how long records may sit in the ring before they are written
+static const auto FLUSH_INTERVAL = std::chrono::milliseconds(50);
+
+
+/************************************************************
+ * Logger class definition
+ ************************************************************/
+const std::size_t Logger::CAPACITY;
+const std::size_t Logger::TEXT_MAX;
+
+
+struct Logger::Impl {
+    // two cache lines
+    struct Record {
+        // position the slot may be claimed at, or that position + 1 once the record is in
+        std::atomic<uint64_t> sequence;
+        int64_t  time;
+        uint64_t session;
+        uint64_t bytes;
+        uint64_t micros;
+        uint8_t  event;
+        uint8_t  length;
+        char     text[TEXT_MAX];
+    };
+
+
+    static_assert(sizeof(Record) == 128, "log records are two cache lines");
+    static_assert((CAPACITY & (CAPACITY-1)) == 0, "ring capacity must be a power of two");
+
+
+    void push(Event event, uint64_t session, std::string_view text, uint64_t bytes, uint64_t micros) {
+        // claim a slot, bounded MPMC queue in the style of Vyukov with a single consumer
+        uint64_t pos = head.load(std::memory_order_relaxed);
+        Record *record;
+        while (true) {
+            record = &ring[pos & (CAPACITY-1)];
+            auto diff = static_cast<int64_t>(record->sequence.load(std::memory_order_acquire) - pos);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            else
+                pos = head.load(std::memory_order_relaxed);
+        }
+
+        record->time    = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::chrono::system_clock::now().time_since_epoch()).count();
+        record->session = session;
+        record->bytes   = bytes;
+        record->micros  = micros;
+        record->event   = static_cast<uint8_t>(event);
+        record->length  = static_cast<uint8_t>(std::min(text.size(), TEXT_MAX));
+        std::memcpy(record->text, text.data(), record->length);
+        record->sequence.store(pos+1, std::memory_order_release);
+    }
+
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            ready.wait_for(lock, FLUSH_INTERVAL, [this]() { return stop || flushTarget > written; });
+            bool stopping = stop;
+            lock.unlock();
+            drain();
+            lock.lock();
+
+            written = tail;
+            flushed.notify_all();
+            if (stopping)
+                return;
+        }
+    }
+
+
+    void drain() {
+        batch.clear();
+        while (true) {
+            Record &record = ring[tail & (CAPACITY-1)];
+            if (record.sequence.load(std::memory_order_acquire) != tail+1)
+                break;
+
+            format(record);
+            record.sequence.store(tail + CAPACITY, std::memory_order_release);
+            ++tail;
+        }
+
+        uint64_t lost = dropped.load(std::memory_order_relaxed);
+        if (lost != reportedDrops) {
+            appendTime(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::system_clock::now().time_since_epoch()).count());
+            batch += std::to_string(lost - reportedDrops) + " records dropped, log is too slow\n";
+            reportedDrops = lost;
+        }
+
+        std::size_t writeSofar = 0;
+        while (writeSofar < batch.size()) {
+            auto wn = ::write(fd, batch.data() + writeSofar, batch.size() - writeSofar);
+            if (wn <= 0)
+                break;
+
+            writeSofar += wn;
+        }
+    }
+
+
+    void format(const Record &record) {
+        appendTime(record.time);
+        batch += "[" + std::to_string(record.session) + "] ";
+
+        std::string text(record.text, record.length);
+        switch (record.event) {
+        case CONNECT:
+            batch += "connect from " + text;
+            break;
+        case DISCONNECT:
+            batch += "disconnect";
+            break;
+        case LOGIN:
+            batch += "login " + text;
+            break;
+        case LOGIN_FAILED:
+            batch += "login failed " + text;
+            break;
+        case COMMAND:
+            batch += text + " (" + std::to_string(record.micros) + "us)";
+            break;
+        case TRANSFER_SENT:
+        case TRANSFER_RECEIVED:
+            batch += record.event == TRANSFER_SENT ? "sent " : "received ";
+            batch += std::to_string(record.bytes) + " bytes in " + std::to_string(record.micros) + "us";
+            break;
+        }
+
+        batch += '\n';
+    }
+
+
+    void appendTime(int64_t nanoseconds) {
+        // localtime and strftime run once per second of log, not once per record
+        std::time_t second = nanoseconds / 1000000000;
+        if (second != cachedSecond) {
+            std::tm tm;
+            localtime_r(&second, &tm);
+            std::strftime(cachedTime, sizeof(cachedTime), "%Y-%m-%d %H:%M:%S", &tm);
+            cachedSecond = second;
+        }
+
+        char millis[8];
+        std::snprintf(millis, sizeof(millis), ".%03d ", static_cast<int>(nanoseconds / 1000000 % 1000));
+        batch += cachedTime;
+        batch += millis;
+    }
+
+
+    int fd;
+    std::vector<Record> ring;
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint64_t> sessions;
+
+    // only touched by the background thread
+    uint64_t tail;
+    uint64_t reportedDrops;
+    std::time_t cachedSecond;
+    char cachedTime[32];
+    std::string batch;
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable flushed;
+    uint64_t flushTarget;
+    uint64_t written;
+    bool stop;
+    std::thread thread;
+};
+
+
+Logger::Logger(const std::string &path) {
+    _impl = std::make_unique<Impl>();
+    _impl->head          = 0;
+    _impl->dropped       = 0;
+    _impl->sessions      = 0;
+    _impl->tail          = 0;
+    _impl->reportedDrops = 0;
+    _impl->cachedSecond  = -1;
+    _impl->flushTarget   = 0;
+    _impl->written       = 0;
+    _impl->stop          = false;
+    _impl->fd = path.empty() ? -1 : open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (_impl->fd == -1)
+        return;
+
+    _impl->ring = std::vector<Impl::Record>(CAPACITY);
+    for (std::size_t i = 0; i < CAPACITY; ++i)
+        _impl->ring[i].sequence.store(i, std::memory_order_relaxed);
+
+    _impl->thread = std::thread(&Impl::run, _impl.get());
+}
+
+
+Logger::~Logger() {
+    if (_impl->fd == -1)
+        return;
+
+    {
+        std::lock_guard<std::mutex> guard(_impl->mutex);
+        _impl->stop = true;
+    }
+
+    _impl->ready.notify_all();
+    _impl->thread.join();
+    close(_impl->fd);
+}
+
+
+bool Logger::isOpen() const {
+    return _impl->fd != -1;
+}
+
+
+uint64_t Logger::nextSessionId() {
+    return _impl->sessions.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+
+void Logger::log(Event event, uint64_t session, std::string_view text, uint64_t bytes, uint64_t micros) {
+    if (_impl->fd != -1)
+        _impl->push(event, session, text, bytes, micros);
+}
+
+
+uint64_t Logger::dropped() const {
+    return _impl->dropped.load(std::memory_order_relaxed);
+}
+
+
+void Logger::flush() {
+    if (_impl->fd == -1)
+        return;
+
+    // records claimed but not yet filled in hold the writer up until they are
+    std::unique_lock<std::mutex> lock(_impl->mutex);
+    uint64_t target = _impl->head.load(std::memory_order_acquire);
+    _impl->flushTarget = std::max(_impl->flushTarget, target);
+    _impl->ready.notify_one();
+    _impl->flushed.wait(lock, [this, target]() { return _impl->written >= target; });
+}
@@ -0,0 +1,63 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+
+// Server log. Sessions push fixed size records into a bounded lock free ring
+// that any number of threads write and one background thread drains. The
+// background thread formats a batch at a time, reusing the date and time it
+// formatted last while the second has not changed, and hands the batch to the
+// file with a single write. Logging never blocks a session: when the ring is
+// full the record is dropped and counted.
+class Logger {
+public:
+    enum Event {
+        CONNECT = 0,
+        DISCONNECT,
+        LOGIN,
+        LOGIN_FAILED,
+        COMMAND,
+        TRANSFER_SENT,
+        TRANSFER_RECEIVED,
+    };
+
+    // an empty path discards every record
+    Logger(const std::string &path);
+
+    Logger(const Logger &) = delete;
+
+    Logger &operator=(const Logger &) = delete;
+
+    // writes what is still in the ring
+    ~Logger();
+
+    bool isOpen() const;
+
+    // number identifying a session in the log
+    uint64_t nextSessionId();
+
+    // text longer than TEXT_MAX is cut. bytes and micros are printed for
+    // commands and transfers only
+    void log(Event event, uint64_t session, std::string_view text,
+             uint64_t bytes = 0, uint64_t micros = 0);
+
+    // records lost to a full ring
+    uint64_t dropped() const;
+
+    // flushes what was logged before the call
+    void flush();
+
+    static const std::size_t CAPACITY = 8192;
+    static const std::size_t TEXT_MAX = 80;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+
+#endif // LOGGER_H
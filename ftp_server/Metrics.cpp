@@ -0,0 +1,261 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <utility>
+#include "Metrics.h"
+
+// eight sub-buckets for each power of two from 1 microsecond to about 70 minutes
+static const int SUB_BUCKET_BITS = 3;
+static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+static const int BUCKETS = (32 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+
+static int bucketOf(uint64_t micros) {
+    micros = std::min<uint64_t>(micros, UINT32_MAX);
+    if (micros < SUB_BUCKETS)
+        return static_cast<int>(micros);
+
+    // the highest bit picks the power of two, the bits below it the sub-bucket
+    int exponent = 63 - __builtin_clzll(micros);
+    int shift = exponent - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + static_cast<int>((micros >> shift) & (SUB_BUCKETS - 1));
+}
+
+
+static uint64_t bucketUpperBound(int bucket) {
+    if (bucket < SUB_BUCKETS)
+        return static_cast<uint64_t>(bucket);
+
+    int shift = bucket / SUB_BUCKETS - 1;
+    uint64_t base = static_cast<uint64_t>(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    return base + (uint64_t(1) << shift) - 1;
+}
+
+
+// only the owning thread writes, so a load and a store are enough
+static void increment(std::atomic<uint64_t> &counter, uint64_t value) {
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+
+/************************************************************
+ * Metrics class definition
+ ************************************************************/
+struct Metrics::Impl {
+    struct Histogram {
+        Histogram() {
+            for (auto &bucket : buckets)
+                bucket = 0;
+
+            count = 0;
+            totalMicros = 0;
+        }
+
+        std::array<std::atomic<uint64_t>, BUCKETS> buckets;
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> totalMicros;
+    };
+
+    struct Transfers {
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> bytes;
+        std::atomic<uint64_t> nanos;
+    };
+
+    struct Shard {
+        Shard() {
+            for (auto &histogram : commands)
+                histogram = nullptr;
+
+            for (auto &direction : transfers) {
+                direction.count = 0;
+                direction.bytes = 0;
+                direction.nanos = 0;
+            }
+        }
+
+        ~Shard() {
+            for (auto &histogram : commands)
+                delete histogram.load(std::memory_order_relaxed);
+        }
+
+        // a histogram is made the first time the thread records the command, most
+        // threads only ever run a few of them. Readers skip the ones still missing
+        Histogram &command(int id) {
+            Histogram *histogram = commands[id].load(std::memory_order_relaxed);
+            if (!histogram) {
+                histogram = new Histogram();
+                commands[id].store(histogram, std::memory_order_release);
+            }
+
+            return *histogram;
+        }
+
+        std::array<std::atomic<Histogram *>, MAX_COMMANDS> commands;
+        std::array<Transfers, 2> transfers;
+    };
+
+
+    Shard &threadShard() {
+        // one shard per thread and server, registered the first time the thread
+        // records into it. Shards outlive their threads
+        static thread_local std::vector<std::pair<uint64_t, Shard *>> cache;
+        for (auto &entry : cache) {
+            if (entry.first == instance)
+                return *entry.second;
+        }
+
+        std::lock_guard<std::mutex> guard(mutex);
+        shards.push_back(std::make_unique<Shard>());
+        cache.emplace_back(instance, shards.back().get());
+        return *shards.back();
+    }
+
+
+    template<typename Visit>
+    void forEachShard(Visit visit) const {
+        std::lock_guard<std::mutex> guard(mutex);
+        for (auto &shard : shards)
+            visit(*shard);
+    }
+
+
+    std::array<uint64_t, BUCKETS> mergedBuckets(int id, uint64_t &count) const {
+        std::array<uint64_t, BUCKETS> merged{};
+        count = 0;
+        forEachShard([&](const Shard &shard) {
+            const Histogram *histogram = shard.commands[id].load(std::memory_order_acquire);
+            if (!histogram)
+                return;
+
+            for (int i = 0; i < BUCKETS; ++i)
+                merged[i] += histogram->buckets[i].load(std::memory_order_relaxed);
+        });
+
+        for (auto bucket : merged)
+            count += bucket;
+
+        return merged;
+    }
+
+
+    static uint64_t percentileOf(const std::array<uint64_t, BUCKETS> &buckets, uint64_t count, double percentile) {
+        auto rank = static_cast<uint64_t>(percentile / 100 * static_cast<double>(count) + 0.5);
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += buckets[i];
+            if (seen >= std::max<uint64_t>(rank, 1))
+                return bucketUpperBound(i);
+        }
+
+        return 0;
+    }
+
+
+    uint64_t instance;
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::vector<std::string> commandNames;
+};
+
+
+Metrics::Metrics() {
+    static std::atomic<uint64_t> instances(0);
+    _impl = std::make_unique<Impl>();
+    _impl->instance = ++instances;
+}
+
+
+Metrics::~Metrics()
+{}
+
+
+int Metrics::commandId(const std::string &name) {
+    std::lock_guard<std::mutex> guard(_impl->mutex);
+    auto &names = _impl->commandNames;
+    auto it = std::find(names.begin(), names.end(), name);
+    if (it != names.end())
+        return static_cast<int>(it - names.begin());
+
+    if (names.size() == MAX_COMMANDS)
+        return -1;
+
+    names.push_back(name);
+    return static_cast<int>(names.size()) - 1;
+}
+
+
+void Metrics::recordCommand(int id, std::chrono::nanoseconds latency) {
+    if (id < 0 || id >= MAX_COMMANDS)
+        return;
+
+    auto micros = static_cast<uint64_t>(std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(latency).count()));
+    auto &histogram = _impl->threadShard().command(id);
+    increment(histogram.buckets[bucketOf(micros)], 1);
+    increment(histogram.count, 1);
+    increment(histogram.totalMicros, micros);
+}
+
+
+void Metrics::recordTransfer(Direction direction, uint64_t bytes, std::chrono::nanoseconds duration) {
+    auto &transfers = _impl->threadShard().transfers[direction];
+    increment(transfers.count, 1);
+    increment(transfers.bytes, bytes);
+    increment(transfers.nanos, static_cast<uint64_t>(std::max<int64_t>(0, duration.count())));
+}
+
+
+std::chrono::microseconds Metrics::commandPercentile(int id, double percentile) const {
+    if (id < 0 || id >= MAX_COMMANDS)
+        return std::chrono::microseconds(0);
+
+    uint64_t count;
+    auto buckets = _impl->mergedBuckets(id, count);
+    return std::chrono::microseconds(Impl::percentileOf(buckets, count, percentile));
+}
+
+
+std::vector<std::string> Metrics::report() const {
+    std::vector<std::string> names;
+    {
+        std::lock_guard<std::mutex> guard(_impl->mutex);
+        names = _impl->commandNames;
+    }
+
+    std::vector<std::string> lines;
+    char line[256];
+    for (int id = 0; id < static_cast<int>(names.size()); ++id) {
+        uint64_t count;
+        auto buckets = _impl->mergedBuckets(id, count);
+        if (count == 0)
+            continue;
+
+        snprintf(line, sizeof(line), "%s count=%llu p50=%lluus p90=%lluus p99=%lluus max=%lluus",
+                 names[id].c_str(), static_cast<unsigned long long>(count),
+                 static_cast<unsigned long long>(Impl::percentileOf(buckets, count, 50)),
+                 static_cast<unsigned long long>(Impl::percentileOf(buckets, count, 90)),
+                 static_cast<unsigned long long>(Impl::percentileOf(buckets, count, 99)),
+                 static_cast<unsigned long long>(Impl::percentileOf(buckets, count, 100)));
+        lines.push_back(line);
+    }
+
+    static const char *DIRECTIONS[] = { "sent", "received" };
+    for (int direction = SENT; direction <= RECEIVED; ++direction) {
+        uint64_t count = 0, bytes = 0, nanos = 0;
+        _impl->forEachShard([&](const Impl::Shard &shard) {
+            count += shard.transfers[direction].count.load(std::memory_order_relaxed);
+            bytes += shard.transfers[direction].bytes.load(std::memory_order_relaxed);
+            nanos += shard.transfers[direction].nanos.load(std::memory_order_relaxed);
+        });
+
+        // throughput while transferring, summed over the time each transfer took
+        double rate = nanos > 0 ? static_cast<double>(bytes) / (static_cast<double>(nanos) / 1e9) / 1024 : 0.0;
+        snprintf(line, sizeof(line), "%s transfers=%llu bytes=%llu rate=%.1fKB/s", DIRECTIONS[direction],
+                 static_cast<unsigned long long>(count), static_cast<unsigned long long>(bytes), rate);
+        lines.push_back(line);
+    }
+
+    return lines;
+}
@@ -0,0 +1,55 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+// Server wide counters read by SITE STATS. Every thread records into its own
+// shard with plain relaxed stores, so recording takes no lock and shares no
+// cache line with other threads; readers add the shards up. Command latencies
+// go into log-linear histograms in the style of HDR histograms: eight buckets
+// per power of two of microseconds, which bounds the error of a percentile to
+// an eighth of its value.
+class Metrics {
+public:
+    enum Direction {
+        SENT = 0,
+        RECEIVED = 1,
+    };
+
+    Metrics();
+
+    Metrics(const Metrics &) = delete;
+
+    Metrics &operator=(const Metrics &) = delete;
+
+    ~Metrics();
+
+    // id under which the latencies of the command are recorded, -1 once
+    // MAX_COMMANDS commands are known. Ids count up from 0 in the order the
+    // names are first seen
+    int commandId(const std::string &name);
+
+    void recordCommand(int id, std::chrono::nanoseconds latency);
+
+    void recordTransfer(Direction direction, uint64_t bytes, std::chrono::nanoseconds duration);
+
+    // upper bound of the bucket holding the given percentile of the latencies
+    std::chrono::microseconds commandPercentile(int id, double percentile) const;
+
+    // one line per command and per transfer direction
+    std::vector<std::string> report() const;
+
+    static const int MAX_COMMANDS = 64;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+
+#endif // METRICS_H
@@ -0,0 +1,172 @@
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include "Mlsx.h"
+
+
+struct LinuxDirent64 {
+    ino64_t        d_ino;
+    off64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+
+static char *appendString(char *out, const char *str) {
+    while (*str)
+        *out++ = *str++;
+
+    return out;
+}
+
+
+static char *appendNumber(char *out, uint64_t num) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = static_cast<char>('0' + num % 10);
+        num /= 10;
+    } while (num != 0);
+
+    while (n > 0)
+        *out++ = digits[--n];
+
+    return out;
+}
+
+
+static char *appendFixedNumber(char *out, int num, int width) {
+    for (int i = width-1; i >= 0; --i) {
+        out[i] = static_cast<char>('0' + num % 10);
+        num /= 10;
+    }
+
+    return out + width;
+}
+
+
+std::size_t formatFacts(char *buf, std::size_t size, const struct stat &fstat, const char *name, std::size_t nameLen) {
+    // longest facts are well below this
+    char facts[128];
+    char *out = facts;
+
+    if (S_ISDIR(fstat.st_mode))
+        out = appendString(out, "type=dir;");
+    else if (S_ISREG(fstat.st_mode))
+        out = appendString(out, "type=file;");
+    else
+        out = appendString(out, "type=OS.unix=special;");
+
+    out = appendString(out, "size=");
+    out = appendNumber(out, static_cast<uint64_t>(fstat.st_size));
+
+    std::tm tm;
+    gmtime_r(&fstat.st_mtime, &tm);
+    out = appendString(out, ";modify=");
+    out = appendFixedNumber(out, tm.tm_year + 1900, 4);
+    out = appendFixedNumber(out, tm.tm_mon + 1, 2);
+    out = appendFixedNumber(out, tm.tm_mday, 2);
+    out = appendFixedNumber(out, tm.tm_hour, 2);
+    out = appendFixedNumber(out, tm.tm_min, 2);
+    out = appendFixedNumber(out, tm.tm_sec, 2);
+
+    // only RETR, STOR, CWD and listing are offered by the server
+    out = appendString(out, ";perm=");
+    if (S_ISDIR(fstat.st_mode)) {
+        if (fstat.st_mode & S_IXUSR)
+            out = appendString(out, "e");
+        if (fstat.st_mode & S_IRUSR)
+            out = appendString(out, "l");
+        if (fstat.st_mode & S_IWUSR)
+            out = appendString(out, "c");
+    }
+    else {
+        if (fstat.st_mode & S_IRUSR)
+            out = appendString(out, "r");
+        if (fstat.st_mode & S_IWUSR)
+            out = appendString(out, "w");
+    }
+    out = appendString(out, "; ");
+
+    std::size_t factsLen = static_cast<std::size_t>(out - facts);
+    std::size_t len = factsLen + nameLen + 2;
+    if (len > size)
+        return 0;
+
+    memcpy(buf, facts, factsLen);
+    memcpy(buf + factsLen, name, nameLen);
+    buf[len-2] = '\r';
+    buf[len-1] = '\n';
+    return len;
+}
+
+
+bool statFacts(int dirfd, const char *name, struct stat &fstat) {
+    static std::atomic<bool> statxSupported{true};
+    int flags = name[0] == '\0' ? AT_EMPTY_PATH : 0;
+    if (statxSupported) {
+        struct statx stx;
+        static const unsigned int MASK = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME;
+        if (statx(dirfd, name, flags | AT_STATX_DONT_SYNC, MASK, &stx) == 0) {
+            fstat.st_mode  = stx.stx_mode;
+            fstat.st_size  = static_cast<off_t>(stx.stx_size);
+            fstat.st_mtime = stx.stx_mtime.tv_sec;
+            return true;
+        }
+
+        if (errno != ENOSYS)
+            return false;
+
+        statxSupported = false;
+    }
+
+    return fstatat(dirfd, name, &fstat, flags) == 0;
+}
+
+
+bool listDirectoryFacts(int dirfd, char *buf, std::size_t size,
+                        const std::function<void(const char *, std::size_t)> &flush)
+{
+    alignas(LinuxDirent64) char dirents[32 * 1024];
+    std::size_t used = 0;
+    while (true) {
+        auto n = syscall(SYS_getdents64, dirfd, dirents, sizeof(dirents));
+        if (n == -1)
+            return false;
+
+        if (n == 0)
+            break;
+
+        for (long pos = 0; pos < n; ) {
+            auto dirent = reinterpret_cast<const LinuxDirent64 *>(dirents + pos);
+            pos += dirent->d_reclen;
+
+            if (std::strcmp(dirent->d_name, ".") == 0 || std::strcmp(dirent->d_name, "..") == 0)
+                continue;
+
+            struct stat fstat;
+            if (!statFacts(dirfd, dirent->d_name, fstat))
+                continue;
+
+            std::size_t nameLen = std::strlen(dirent->d_name);
+            std::size_t len = formatFacts(buf + used, size - used, fstat, dirent->d_name, nameLen);
+            if (len == 0 && used > 0) {
+                flush(buf, used);
+                used = 0;
+                len = formatFacts(buf, size, fstat, dirent->d_name, nameLen);
+            }
+
+            used += len;
+        }
+    }
+
+    if (used > 0)
+        flush(buf, used);
+
+    return true;
+}
@@ -0,0 +1,28 @@
+#ifndef MLSX_H
+#define MLSX_H
+
+#include <sys/stat.h>
+#include <functional>
+#include <string>
+
+
+// Formats the RFC 3659 facts of an entry followed by its name and CRLF into
+// buf. Returns the length written, or 0 if it does not fit in size bytes.
+std::size_t formatFacts(char *buf, std::size_t size, const struct stat &fstat, const char *name, std::size_t nameLen);
+
+
+// Stats name relative to the directory open at dirfd, or the file open at dirfd
+// itself when name is empty, asking the kernel only for the fields MLSD and
+// MLST need.
+bool statFacts(int dirfd, const char *name, struct stat &fstat);
+
+
+// Writes the facts of every entry of the directory open at dirfd into buf,
+// handing it to flush whenever it fills up, and once more at the end.
+// Entries are read in bulk with getdents64 and stated relative to dirfd, so
+// nothing is allocated per entry. Returns false if the directory cannot be read.
+bool listDirectoryFacts(int dirfd, char *buf, std::size_t size,
+                        const std::function<void(const char *, std::size_t)> &flush);
+
+
+#endif // MLSX_H
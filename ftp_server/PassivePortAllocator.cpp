@@ -0,0 +1,86 @@
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "PassivePortAllocator.h"
+
+
+/************************************************************
+ * PassivePortAllocator class definition
+ ************************************************************/
+struct PassivePortAllocator::Impl {
+    struct Shard {
+        mutable std::mutex mutex;
+        std::deque<uint16_t> freePorts;
+    };
+
+
+    Shard &shardOf(uint16_t port) {
+        return shards[(port - portMin) % shards.size()];
+    }
+
+
+    uint16_t portMin;
+    uint16_t portMax;
+    std::vector<Shard> shards;
+};
+
+
+PassivePortAllocator::PassivePortAllocator(uint16_t portMin, uint16_t portMax, unsigned shards) {
+    _impl = std::make_unique<Impl>();
+    _impl->portMin = std::min(portMin, portMax);
+    _impl->portMax = std::max(portMin, portMax);
+
+    std::size_t ports = static_cast<std::size_t>(_impl->portMax - _impl->portMin) + 1;
+    _impl->shards = std::vector<Impl::Shard>(std::max<std::size_t>(1, std::min<std::size_t>(shards, ports)));
+
+    // hand out ports from the top of the range first, like the old linear probing did
+    for (int32_t port = _impl->portMax; port >= _impl->portMin; --port)
+        _impl->shardOf(static_cast<uint16_t>(port)).freePorts.push_back(static_cast<uint16_t>(port));
+}
+
+
+PassivePortAllocator::~PassivePortAllocator()
+{}
+
+
+bool PassivePortAllocator::acquire(uint16_t &port) {
+    // each thread starts from its own shard, and only walks to the others when it runs dry
+    static thread_local std::size_t home = std::hash<std::thread::id>()(std::this_thread::get_id());
+
+    auto &shards = _impl->shards;
+    for (std::size_t i = 0; i < shards.size(); ++i) {
+        auto &shard = shards[(home + i) % shards.size()];
+        std::lock_guard<std::mutex> guard(shard.mutex);
+        if (!shard.freePorts.empty()) {
+            port = shard.freePorts.front();
+            shard.freePorts.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+void PassivePortAllocator::release(uint16_t port) {
+    if (port < _impl->portMin || port > _impl->portMax)
+        return;
+
+    auto &shard = _impl->shardOf(port);
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    shard.freePorts.push_back(port);
+}
+
+
+std::size_t PassivePortAllocator::available() const {
+    std::size_t count = 0;
+    for (const auto &shard : _impl->shards) {
+        std::lock_guard<std::mutex> guard(shard.mutex);
+        count += shard.freePorts.size();
+    }
+
+    return count;
+}
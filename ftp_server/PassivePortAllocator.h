@@ -0,0 +1,34 @@
+#ifndef PASSIVEPORTALLOCATOR_H
+#define PASSIVEPORTALLOCATOR_H
+
+#include <cstdint>
+#include <memory>
+
+
+// Hands out ports for passive data connections. Free ports are spread over
+// several independently locked shards so concurrent PASV commands rarely
+// contend, and taking or returning a port is O(1).
+class PassivePortAllocator {
+public:
+    PassivePortAllocator(uint16_t portMin, uint16_t portMax, unsigned shards);
+
+    PassivePortAllocator(const PassivePortAllocator &) = delete;
+
+    PassivePortAllocator &operator=(const PassivePortAllocator &) = delete;
+
+    ~PassivePortAllocator();
+
+    // returns false if every port in the range is handed out
+    bool acquire(uint16_t &port);
+
+    void release(uint16_t port);
+
+    std::size_t available() const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+
+#endif // PASSIVEPORTALLOCATOR_H
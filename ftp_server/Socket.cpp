@@ -3,11 +3,13 @@
 #include <sys/wait.h>
 #include <sys/ioctl.h>
 #include <sys/poll.h>
+#include <sys/sendfile.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <ifaddrs.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -29,9 +31,74 @@ const char *SocketException::what() const noexcept { return strerror(errno); }
 /************************************************************
  * Socket class definition
  ************************************************************/
+static const std::size_t RECEIVE_BUF_MAX = 4096;
+
+
 struct Socket::Impl {
+    // address of either end of the connection, IPv4 mapped addresses in dotted form
+    std::string address(int (*name)(int, sockaddr *, socklen_t *)) const {
+        char ip[INET6_ADDRSTRLEN];
+        if (protocol == IPv4) {
+            sockaddr_in addr;
+            socklen_t len = sizeof(sockaddr_in);
+            name(sockfd, reinterpret_cast<sockaddr*>(&addr), &len);
+            inet_ntop(AF_INET, &(addr.sin_addr), ip, sizeof(ip));
+        }
+        else {
+            sockaddr_in6 addr;
+            socklen_t len = sizeof(sockaddr_in6);
+            name(sockfd, reinterpret_cast<sockaddr*>(&addr), &len);
+            if (IN6_IS_ADDR_V4MAPPED(&addr.sin6_addr)) {
+                inet_ntop(AF_INET, reinterpret_cast<in_addr *>(addr.sin6_addr.s6_addr + 12), ip, sizeof(ip));
+            }
+            else
+                inet_ntop(AF_INET6, &(addr.sin6_addr), ip, sizeof(ip));
+        }
+
+        return std::string(ip);
+    }
+
+
+    // pull as much as the kernel has into the receive buffer with a single read.
+    // Returns false if the socket is non blocking and nothing is available
+    bool fillReceiveBuffer() {
+        if (!rxBuf)
+            rxBuf = std::make_unique<char[]>(RECEIVE_BUF_MAX);
+
+        // make room at the end for new bytes, keeping the unfinished line
+        if (rxBegin == rxEnd)
+            rxBegin = rxEnd = 0;
+        else if (rxEnd == RECEIVE_BUF_MAX) {
+            memmove(rxBuf.get(), rxBuf.get() + rxBegin, rxEnd - rxBegin);
+            rxEnd -= rxBegin;
+            rxBegin = 0;
+        }
+
+        while (true) {
+            auto rn = ::read(sockfd, rxBuf.get() + rxEnd, RECEIVE_BUF_MAX - rxEnd);
+            if (rn == -1 && errno == EINTR)
+                continue;
+
+            if (rn == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return false;
+
+            if (rn == -1)
+                throw SocketException();
+
+            if (rn == 0)
+                peerClosed = true;
+
+            rxEnd += static_cast<std::size_t>(rn);
+            return true;
+        }
+    }
+
     int sockfd;
     NetProtocol protocol;
+    std::unique_ptr<char[]> rxBuf;
+    std::size_t rxBegin;
+    std::size_t rxEnd;
+    bool peerClosed;
 };
 
 
@@ -39,6 +106,9 @@ Socket::Socket() {
     _impl = std::make_unique<Impl>();
     _impl->sockfd = -1;
     _impl->protocol = UNSPECIFIED;
+    _impl->rxBegin = 0;
+    _impl->rxEnd = 0;
+    _impl->peerClosed = false;
 }
 
 
@@ -71,6 +141,29 @@ int Socket::pollForRead(int timeout) {
 }
 
 
+void Socket::setNonBlocking(bool nonBlocking) {
+    int flags = fcntl(_impl->sockfd, F_GETFL, 0);
+    if (flags == -1)
+        throw SocketException();
+
+    flags = nonBlocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+    if (fcntl(_impl->sockfd, F_SETFL, flags) == -1)
+        throw SocketException();
+}
+
+
+void Socket::setNoDelay(bool noDelay) {
+    int flag = noDelay ? 1 : 0;
+    if (setsockopt(_impl->sockfd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) == -1)
+        throw SocketException();
+}
+
+
+int Socket::nativeHandle() const {
+    return _impl->sockfd;
+}
+
+
 bool Socket::isValid() const {
     return _impl->sockfd != -1;
 }
@@ -83,25 +176,12 @@ NetProtocol Socket::netProtocol() const {
 
 std::string Socket::IPAddr() const {
     // retrieve local ip address will be used for PORT and EPRT cmd
-    char localIp[INET6_ADDRSTRLEN];
-    if (_impl->protocol == IPv4) {
-        sockaddr_in addr;
-        socklen_t len = sizeof(sockaddr_in);
-        getsockname(_impl->sockfd, reinterpret_cast<sockaddr*>(&addr), &len);
-        inet_ntop(AF_INET, &(addr.sin_addr), localIp, sizeof(localIp));
-    }
-    else {
-        sockaddr_in6 addr;
-        socklen_t len = sizeof(sockaddr_in6);
-        getsockname(_impl->sockfd, reinterpret_cast<sockaddr*>(&addr), &len);
-        if (IN6_IS_ADDR_V4MAPPED(&addr.sin6_addr)) {
-            inet_ntop(AF_INET, reinterpret_cast<in_addr *>(addr.sin6_addr.s6_addr + 12), localIp, sizeof(localIp));
-        }
-        else
-            inet_ntop(AF_INET6, &(addr.sin6_addr), localIp, sizeof(localIp));
-    }
+    return _impl->address(getsockname);
+}
+
 
-    return std::string(localIp);
+std::string Socket::peerIPAddr() const {
+    return _impl->address(getpeername);
 }
 
 
@@ -109,7 +189,17 @@ std::size_t Socket::write(const Byte *buf, std::size_t size) {
     size_t writeSofar = 0;
     while (writeSofar < size) {
         auto wn = send(_impl->sockfd, buf + writeSofar, size - writeSofar, MSG_NOSIGNAL);
-        if (wn < 0)
+        if (wn < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // non blocking socket is full, wait until the peer drains it
+            struct pollfd fds;
+            fds.fd = _impl->sockfd;
+            fds.events = POLLOUT;
+            if (::poll(&fds, 1, -1) == -1 && errno != EINTR)
+                throw SocketException();
+
+            continue;
+        }
+        else if (wn < 0)
             throw SocketException();
 
         writeSofar += static_cast<size_t>(wn);
@@ -119,8 +209,135 @@ std::size_t Socket::write(const Byte *buf, std::size_t size) {
 }
 
 
+std::size_t Socket::writeSome(const Byte *buf, std::size_t size) {
+    while (true) {
+        auto wn = send(_impl->sockfd, buf, size, MSG_NOSIGNAL);
+        if (wn >= 0)
+            return static_cast<std::size_t>(wn);
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+
+        if (errno != EINTR)
+            throw SocketException();
+    }
+}
+
+
+// sent counts the bytes that reached the socket, also when splicing fails part way.
+// The file offset runs ahead of it by what is still in the pipe.
+static std::size_t spliceFile(int sockfd, int fileFd, off_t offset, std::size_t size, std::size_t &sent) {
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) == -1)
+        throw SocketException();
+
+    // a bigger pipe means fewer round trips through it
+    static const int PIPE_SIZE = 1 << 20;
+    fcntl(pipefd[1], F_SETPIPE_SZ, PIPE_SIZE);
+
+    sent = 0;
+    try {
+        while (sent < size) {
+            auto in = splice(fileFd, &offset, pipefd[1], nullptr, size - sent, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (in == -1 && errno == EINTR)
+                continue;
+
+            if (in == -1)
+                throw SocketException();
+
+            if (in == 0)
+                break;
+
+            while (in > 0) {
+                auto out = splice(pipefd[0], nullptr, sockfd, nullptr, static_cast<std::size_t>(in), SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (out == -1 && errno == EINTR)
+                    continue;
+
+                if (out == -1)
+                    throw SocketException();
+
+                in -= out;
+                sent += static_cast<std::size_t>(out);
+            }
+        }
+    } catch (const SocketException &) {
+        int err = errno;
+        close(pipefd[0]);
+        close(pipefd[1]);
+        errno = err;
+        throw;
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return sent;
+}
+
+
+std::size_t Socket::sendFile(int fileFd, off_t offset, std::size_t size) {
+    std::size_t writeSoFar = 0;
+    while (writeSoFar < size) {
+        auto wn = sendfile(_impl->sockfd, fileFd, &offset, size - writeSoFar);
+        if (wn == -1 && errno == EINTR)
+            continue;
+
+        // file system cannot feed sendfile, try moving the pages through a pipe
+        if (wn == -1 && (errno == EINVAL || errno == ENOSYS) && writeSoFar == 0) {
+            std::size_t spliced = 0;
+            try {
+                return spliceFile(_impl->sockfd, fileFd, offset, size, spliced);
+            } catch (const SocketException &) {
+                if (errno != EINVAL)
+                    throw;
+
+                // what went out must not be sent again, the caller resumes after it
+                if (spliced > 0)
+                    return spliced;
+            }
+
+            // nor splice, copy it through user space
+            Byte buf[64 * 1024];
+            while (writeSoFar < size) {
+                auto rn = pread(fileFd, buf, std::min(sizeof(buf), size - writeSoFar), offset);
+                if (rn == -1 && errno == EINTR)
+                    continue;
+
+                if (rn == -1)
+                    throw SocketException();
+
+                if (rn == 0)
+                    break;
+
+                write(buf, static_cast<std::size_t>(rn));
+                offset += rn;
+                writeSoFar += static_cast<std::size_t>(rn);
+            }
+
+            return writeSoFar;
+        }
+
+        if (wn == -1)
+            throw SocketException();
+
+        // file was truncated while sending it
+        if (wn == 0)
+            break;
+
+        writeSoFar += static_cast<std::size_t>(wn);
+    }
+
+    return writeSoFar;
+}
+
+
 std::size_t Socket::read(Byte *buf, std::size_t size) {
-    std::size_t readSoFar = 0;
+    // bytes read ahead by readline come first
+    std::size_t readSoFar = std::min(size, _impl->rxEnd - _impl->rxBegin);
+    if (readSoFar > 0) {
+        memcpy(buf, _impl->rxBuf.get() + _impl->rxBegin, readSoFar);
+        _impl->rxBegin += readSoFar;
+    }
+
     while (readSoFar < size) {
         auto rn = ::read(_impl->sockfd, buf + readSoFar, static_cast<unsigned long>(size - readSoFar));
         if (rn == -1)
@@ -137,21 +354,38 @@ std::size_t Socket::read(Byte *buf, std::size_t size) {
 
 
 std::size_t Socket::readline(char *buf, std::size_t size) {
-    char ch;
-    std::size_t readSoFar = 0;
-    do {
-        ssize_t rn = ::read(_impl->sockfd, &ch, 1);
-        if (rn == -1)
-            throw SocketException();
+    while (true) {
+        // hand out a line as soon as it is complete in the receive buffer
+        std::size_t buffered = _impl->rxEnd - _impl->rxBegin;
+        const char *begin = _impl->rxBuf.get() + _impl->rxBegin;
+        const char *eol = nullptr;
+        if (buffered > 0)
+            eol = static_cast<const char *>(memchr(begin, '\n', std::min(buffered, size)));
+
+        // a full buffer without a line end can only be given out as is
+        bool full = buffered >= std::min(size, RECEIVE_BUF_MAX);
+        if (eol != nullptr || full || (_impl->peerClosed && buffered > 0)) {
+            std::size_t len = eol != nullptr ? static_cast<std::size_t>(eol - begin) + 1 : std::min(buffered, size);
+            memcpy(buf, begin, len);
+            _impl->rxBegin += len;
+            return len;
+        }
 
-        if (rn == 0)
-            break;
+        if (_impl->peerClosed || !_impl->fillReceiveBuffer())
+            return 0;
+    }
+}
 
-        buf[readSoFar] = ch;
-        readSoFar += static_cast<std::size_t>(rn);
-    } while (ch != '\n' && readSoFar < size);
 
-    return readSoFar;
+bool Socket::peerClosed() const {
+    return _impl->peerClosed;
+}
+
+
+void Socket::shutdown() {
+    // wakes up any thread blocked on the socket, it is closed by its owner later
+    if (_impl && _impl->sockfd != -1)
+        ::shutdown(_impl->sockfd, SHUT_RDWR);
 }
 
 
@@ -160,6 +394,9 @@ Socket Socket::accept(const Socket &listenSock) {
     sockaddr_storage peerAddr;
     socklen_t len = sizeof(peerAddr);
     sockfd = ::accept(listenSock._impl->sockfd, reinterpret_cast<sockaddr *>(&peerAddr), &len);
+    if (sockfd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return Socket();
+
     if (sockfd == -1)
         throw SocketException();
 
@@ -170,7 +407,29 @@ Socket Socket::accept(const Socket &listenSock) {
 }
 
 
-Socket Socket::connect(const std::string &host, uint16_t port) {
+// completes a non-blocking connect, -1 with errno set if it fails or times out
+static int finishConnect(int fd, int timeout) {
+    struct pollfd fds;
+    fds.fd = fd;
+    fds.events = POLLOUT;
+    int n = ::poll(&fds, 1, timeout);
+    if (n == 0)
+        errno = ETIMEDOUT;
+
+    if (n <= 0)
+        return -1;
+
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+        return -1;
+
+    errno = error;
+    return error == 0 ? 0 : -1;
+}
+
+
+Socket Socket::connect(const std::string &host, uint16_t port, int timeout) {
     int sockfd = -1;
     NetProtocol netProtocol = UNSPECIFIED;
     std::string portStr = std::to_string(port);
@@ -191,11 +450,23 @@ Socket Socket::connect(const std::string &host, uint16_t port) {
         if (fd == -1)
             continue;
 
-        if (::connect(fd, ipAddr->ai_addr, ipAddr->ai_addrlen) == -1) {
+        // connect without blocking when there is a timeout, then go back to blocking
+        int flags = fcntl(fd, F_GETFL, 0);
+        if (timeout >= 0)
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+        int res = ::connect(fd, ipAddr->ai_addr, ipAddr->ai_addrlen);
+        if (res == -1 && errno == EINPROGRESS && timeout >= 0)
+            res = finishConnect(fd, timeout);
+
+        if (res == -1) {
             close(fd);
             continue;
         }
 
+        if (timeout >= 0)
+            fcntl(fd, F_SETFL, flags);
+
         sockfd = fd;
         netProtocol = ipAddr->ai_family == AF_INET ? IPv4 : IPv6;
 
@@ -216,7 +487,7 @@ Socket Socket::connect(const std::string &host, uint16_t port) {
 }
 
 
-Socket Socket::listen(uint16_t port, int queueMax, NetProtocol netProtocol) {
+Socket Socket::listen(uint16_t port, int queueMax, NetProtocol netProtocol, bool reusePort) {
      int sockfd = -1;
      std::string portStr = std::to_string(port);
 
@@ -245,6 +516,8 @@ Socket Socket::listen(uint16_t port, int queueMax, NetProtocol netProtocol) {
 
         int reuse = 1;
         bool socketUnusable = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int)) == -1 ||
+                              (reusePort &&
+                               setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(int)) == -1) ||
                               bind(sockfd, ipAddr->ai_addr, ipAddr->ai_addrlen)                 == -1 ||
                               ::listen(sockfd, queueMax)                                        == -1;
 
@@ -1,6 +1,7 @@
 #ifndef SOCKET_H
 #define SOCKET_H
 
+#include <sys/types.h>
 #include <string>
 #include <memory>
 
@@ -37,23 +38,45 @@ public:
 
     int pollForRead(int timeout);
 
+    void setNonBlocking(bool nonBlocking);
+
+    void setNoDelay(bool noDelay);
+
+    int nativeHandle() const;
+
     bool isValid() const;
 
     NetProtocol netProtocol() const;
 
     std::string IPAddr() const;
 
+    std::string peerIPAddr() const;
+
     std::size_t write(const Byte *buf, std::size_t size);
 
+    // sends what a non-blocking socket takes without waiting, 0 when it is full
+    std::size_t writeSome(const Byte *buf, std::size_t size);
+
+    // returns the bytes sent, fewer than size if the file ends or a fallback stops part way
+    std::size_t sendFile(int fileFd, off_t offset, std::size_t size);
+
     std::size_t read(Byte *buf, std::size_t size);
 
     std::size_t readline(char *buf, std::size_t size);
 
+    bool peerClosed() const;
+
+    void shutdown();
+
+    // an invalid socket when a non-blocking listener has no connection pending
     static Socket accept(const Socket &listenSock);
 
-    static Socket connect(const std::string &host, uint16_t port);
+    // gives up on an address after timeout milliseconds, -1 leaves it to the kernel
+    static Socket connect(const std::string &host, uint16_t port, int timeout = -1);
 
-    static Socket listen(uint16_t port, int queueMax, NetProtocol netProtocol);
+    // with reusePort several sockets can listen on the port, the kernel spreads
+    // new connections over them
+    static Socket listen(uint16_t port, int queueMax, NetProtocol netProtocol, bool reusePort = false);
 
 private:
     struct Impl;
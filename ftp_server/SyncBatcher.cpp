@@ -0,0 +1,115 @@
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "SyncBatcher.h"
+
+
+/************************************************************
+ * SyncBatcher class definition
+ ************************************************************/
+struct SyncBatcher::Impl {
+    struct Request {
+        int fd;
+        bool done;
+        int error;
+    };
+
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            ready.wait(lock, [this]() { return stop || !requests.empty(); });
+            if (requests.empty())
+                return;
+
+            // let the rest of the burst join the batch
+            if (!stop)
+                ready.wait_for(lock, window, [this]() { return stop; });
+
+            std::vector<Request *> batch;
+            batch.swap(requests);
+            lock.unlock();
+            flush(batch);
+            lock.lock();
+
+            for (auto request : batch)
+                request->done = true;
+
+            finished.notify_all();
+        }
+    }
+
+
+    static void flush(const std::vector<Request *> &batch) {
+        // one syncfs per file system, its result stands for every file on it
+        std::map<dev_t, std::vector<Request *>> devices;
+        for (auto request : batch) {
+            struct stat fstat;
+            if (::fstat(request->fd, &fstat) == -1)
+                request->error = errno;
+            else
+                devices[fstat.st_dev].push_back(request);
+        }
+
+        // syncfs only reports writeback errors since Linux 5.8, the fdatasync of each
+        // file does on every kernel. Its pages are clean by then and its journal
+        // commit is done, so it costs little
+        for (auto &device : devices) {
+            int error = syncfs(device.second.front()->fd) == -1 ? errno : 0;
+            for (auto request : device.second) {
+                request->error = error;
+                if (error == 0 && fdatasync(request->fd) == -1)
+                    request->error = errno;
+            }
+        }
+    }
+
+
+    std::chrono::milliseconds window;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable finished;
+    std::vector<Request *> requests;
+    std::thread thread;
+    bool stop;
+};
+
+
+SyncBatcher::SyncBatcher(std::chrono::milliseconds window) {
+    _impl = std::make_unique<Impl>();
+    _impl->window = window;
+    _impl->stop   = false;
+    _impl->thread = std::thread(&Impl::run, _impl.get());
+}
+
+
+SyncBatcher::~SyncBatcher() {
+    {
+        std::lock_guard<std::mutex> guard(_impl->mutex);
+        _impl->stop = true;
+    }
+
+    _impl->ready.notify_all();
+    _impl->thread.join();
+}
+
+
+bool SyncBatcher::sync(int fd) {
+    Impl::Request request{fd, false, 0};
+    std::unique_lock<std::mutex> lock(_impl->mutex);
+    _impl->requests.push_back(&request);
+    _impl->ready.notify_one();
+    _impl->finished.wait(lock, [&request]() { return request.done; });
+
+    if (request.error != 0) {
+        errno = request.error;
+        return false;
+    }
+
+    return true;
+}
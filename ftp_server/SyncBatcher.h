@@ -0,0 +1,34 @@
+#ifndef SYNCBATCHER_H
+#define SYNCBATCHER_H
+
+#include <chrono>
+#include <memory>
+
+
+// Group commit for uploads. Callers block in sync() while a background thread
+// gathers the requests arriving within one window and flushes each file
+// system involved with a single syncfs, so a burst of uploads pays for one
+// journal commit instead of one per file. The syncfs writes back every dirty
+// page of the file system, uploads that are still running included, so under
+// heavy ingest a batch takes as long as the whole backlog of writeback.
+class SyncBatcher {
+public:
+    SyncBatcher(std::chrono::milliseconds window);
+
+    SyncBatcher(const SyncBatcher &) = delete;
+
+    SyncBatcher &operator=(const SyncBatcher &) = delete;
+
+    // flushes what is still queued
+    ~SyncBatcher();
+
+    // returns once the data of fd is on disk, false with errno set on failure
+    bool sync(int fd);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+
+#endif // SYNCBATCHER_H
@@ -0,0 +1,72 @@
+#include <atomic>
+#include "TokenBucket.h"
+
+static const int64_t NANOS_PER_SECOND = 1000000000;
+static const int64_t BURST = NANOS_PER_SECOND / 10;
+
+
+/************************************************************
+ * TokenBucket class definition
+ ************************************************************/
+struct TokenBucket::Impl {
+    std::atomic<uint64_t> rate;
+
+    // steady clock time at which everything reserved so far has been paid for
+    std::atomic<int64_t> deadline;
+};
+
+
+TokenBucket::TokenBucket(uint64_t bytesPerSecond) {
+    _impl = std::make_unique<Impl>();
+    _impl->rate = bytesPerSecond;
+    _impl->deadline = 0;
+}
+
+
+TokenBucket::~TokenBucket()
+{}
+
+
+void TokenBucket::setRate(uint64_t bytesPerSecond) {
+    _impl->rate = bytesPerSecond;
+}
+
+
+uint64_t TokenBucket::rate() const {
+    return _impl->rate;
+}
+
+
+static int64_t costOf(std::size_t bytes, uint64_t rate) {
+    return static_cast<int64_t>(static_cast<double>(bytes) * NANOS_PER_SECOND / static_cast<double>(rate));
+}
+
+
+std::chrono::nanoseconds TokenBucket::reserve(std::size_t bytes) {
+    uint64_t rate = _impl->rate.load(std::memory_order_relaxed);
+    if (rate == 0)
+        return std::chrono::nanoseconds(0);
+
+    int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t cost = costOf(bytes, rate);
+
+    // an idle bucket starts from now, it does not bank the time it was idle
+    int64_t deadline = _impl->deadline.load(std::memory_order_relaxed);
+    int64_t next;
+    do {
+        next = std::max(deadline, now) + cost;
+    } while (!_impl->deadline.compare_exchange_weak(deadline, next, std::memory_order_relaxed));
+
+    return std::chrono::nanoseconds(std::max<int64_t>(0, next - now - BURST));
+}
+
+
+void TokenBucket::refund(std::size_t bytes) {
+    uint64_t rate = _impl->rate.load(std::memory_order_relaxed);
+    if (rate == 0)
+        return;
+
+    // a deadline pushed into the past is harmless, reserve starts from now
+    _impl->deadline.fetch_sub(costOf(bytes, rate), std::memory_order_relaxed);
+}
@@ -0,0 +1,42 @@
+#ifndef TOKENBUCKET_H
+#define TOKENBUCKET_H
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+
+// Bandwidth limit shared by any number of transfers. Each transfer reserves
+// the bytes it is about to move and waits for as long as it is told to. The
+// bucket keeps a single atomic deadline (the generic cell rate algorithm), so
+// reserving is one compare and swap and the steady clock, and transfers are
+// served in the order of their reservations, which keeps them fair. Up to a
+// tenth of a second worth of bytes may go through as a burst.
+class TokenBucket {
+public:
+    // 0 bytes per second means unlimited
+    TokenBucket(uint64_t bytesPerSecond);
+
+    TokenBucket(const TokenBucket &) = delete;
+
+    TokenBucket &operator=(const TokenBucket &) = delete;
+
+    ~TokenBucket();
+
+    void setRate(uint64_t bytesPerSecond);
+
+    uint64_t rate() const;
+
+    // returns how long to wait before the bytes may be moved
+    std::chrono::nanoseconds reserve(std::size_t bytes);
+
+    // gives back a reservation whose bytes were never moved
+    void refund(std::size_t bytes);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+
+#endif // TOKENBUCKET_H
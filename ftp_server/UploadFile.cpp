@@ -0,0 +1,125 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include "SyncBatcher.h"
+#include "UploadFile.h"
+#include "Utility.h"
+
+static const mode_t FILE_MODE = 0644;
+static const int LINK_ATTEMPTS = 16;
+
+
+/************************************************************
+ * UploadFile class definition
+ ************************************************************/
+struct UploadFile::Impl {
+    std::string hiddenName() const {
+        // unique among the threads and processes that may upload the same target
+        static std::atomic<unsigned> counter(0);
+        return "." + name + "." + std::to_string(getpid()) + "." + std::to_string(counter++);
+    }
+
+
+    FileDescriptor dir;
+    std::string name;
+    std::string tempName;
+    FileDescriptor file;
+    bool published;
+};
+
+
+UploadFile::UploadFile(FileDescriptor dir, std::string name) {
+    _impl = std::make_unique<Impl>();
+    _impl->dir       = std::move(dir);
+    _impl->name      = std::move(name);
+    _impl->published = false;
+}
+
+
+UploadFile::~UploadFile() {
+    if (!_impl->published && !_impl->tempName.empty())
+        unlinkat(_impl->dir.get(), _impl->tempName.c_str(), 0);
+}
+
+
+bool UploadFile::open(bool directIo) {
+    int flags = O_TMPFILE | O_WRONLY | O_CLOEXEC;
+    _impl->file.reset(openat(_impl->dir.get(), ".", flags | (directIo ? O_DIRECT : 0), FILE_MODE));
+    if (!_impl->file.isValid() && directIo && errno == EINVAL)
+        _impl->file.reset(openat(_impl->dir.get(), ".", flags, FILE_MODE));
+
+    if (_impl->file.isValid())
+        return true;
+
+    // file system without O_TMPFILE, fall back to a named file in the same directory
+    for (int attempt = 0; attempt < LINK_ATTEMPTS && !_impl->file.isValid(); ++attempt) {
+        std::string hidden = _impl->hiddenName();
+        _impl->file.reset(openat(_impl->dir.get(), hidden.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, FILE_MODE));
+        if (_impl->file.isValid())
+            _impl->tempName = hidden;
+        else if (errno != EEXIST)
+            return false;
+    }
+
+    if (!_impl->file.isValid())
+        return false;
+
+    if (directIo) {
+        int flags = fcntl(_impl->file.get(), F_GETFL);
+        fcntl(_impl->file.get(), F_SETFL, flags | O_DIRECT);
+    }
+
+    return true;
+}
+
+
+int UploadFile::fd() const {
+    return _impl->file.get();
+}
+
+
+bool UploadFile::publish() {
+    int dir = _impl->dir.get();
+    if (_impl->tempName.empty()) {
+        // give the unnamed file a name, directly as the target if it does not exist yet
+        std::string procPath = "/proc/self/fd/" + std::to_string(_impl->file.get());
+        if (linkat(AT_FDCWD, procPath.c_str(), dir, _impl->name.c_str(), AT_SYMLINK_FOLLOW) == 0) {
+            _impl->published = true;
+            return true;
+        }
+
+        if (errno != EEXIST)
+            return false;
+
+        for (int attempt = 0; attempt < LINK_ATTEMPTS && _impl->tempName.empty(); ++attempt) {
+            std::string hidden = _impl->hiddenName();
+            if (linkat(AT_FDCWD, procPath.c_str(), dir, hidden.c_str(), AT_SYMLINK_FOLLOW) == 0)
+                _impl->tempName = hidden;
+            else if (errno != EEXIST)
+                return false;
+        }
+
+        if (_impl->tempName.empty())
+            return false;
+    }
+
+    // rename replaces an existing target atomically
+    if (renameat(dir, _impl->tempName.c_str(), dir, _impl->name.c_str()) == -1)
+        return false;
+
+    _impl->published = true;
+    return true;
+}
+
+
+bool UploadFile::syncDirectory(SyncBatcher *batcher) {
+    // the directory may be held by an O_PATH fd, which cannot be synced
+    FileDescriptor dir(openat(_impl->dir.get(), ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (!dir.isValid())
+        return false;
+
+    return batcher ? batcher->sync(dir.get()) : fsync(dir.get()) == 0;
+}
@@ -0,0 +1,48 @@
+#ifndef UPLOADFILE_H
+#define UPLOADFILE_H
+
+#include <sys/types.h>
+#include <memory>
+#include <string>
+#include "Utility.h"
+
+
+class SyncBatcher;
+
+
+// File a STOR writes into before it replaces its target in one step. It is
+// created unnamed with O_TMPFILE in the target's directory, so publishing it is
+// a link on the same file system, or as a hidden dot file next to the target
+// where O_TMPFILE is not supported. An upload that is never published leaves
+// nothing behind. Everything happens relative to the directory fd, which may
+// be an O_PATH one, so the target is never looked up by its full path again.
+class UploadFile {
+public:
+    UploadFile(FileDescriptor dir, std::string name);
+
+    UploadFile(const UploadFile &) = delete;
+
+    UploadFile &operator=(const UploadFile &) = delete;
+
+    ~UploadFile();
+
+    // false with errno set if no file can be created next to the target. With
+    // directIo the file is opened with O_DIRECT if its file system allows it
+    bool open(bool directIo);
+
+    int fd() const;
+
+    // replaces the target with the file, false with errno set on failure
+    bool publish();
+
+    // makes a new name in the directory survive a crash, as part of the batch
+    // of batcher if there is one. False with errno set on failure
+    bool syncDirectory(SyncBatcher *batcher = nullptr);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+
+#endif // UPLOADFILE_H
@@ -1,7 +1,6 @@
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <iomanip>
-#include <stack>
+#include <cstring>
 #include "Utility.h"
 
 
@@ -26,43 +25,47 @@ bool isRegularFile(const std::string &file) {
 }
 
 
-std::ostream &logDateTime(std::ostream &stream) {
-    std::time_t now = std::time(nullptr);
-    std::tm tm = *std::localtime(&now);
-    return stream << std::put_time(&tm, "%c %Z") << ": ";
-}
-
-
 bool isDiretory(const std::string &directory) {
     struct stat fstat;
     return stat(directory.c_str(), &fstat) == 0 && S_ISDIR(fstat.st_mode);
 }
 
 
-std::string normalizePath(const std::string &path) {
-    std::stack<std::string> curr;
+std::size_t normalizePath(std::string_view path, char *out) {
+    std::size_t size = 0;
 
     std::size_t begin = 0;
-    for (std::size_t i = 0; i <= path.size(); ++i) {
-        if (path[i] == '/' || i == path.size()) {
-            auto p = path.substr(begin, i-begin);
-            if (p == ".." && !curr.empty())
-                curr.pop();
-            else if (p != "." && p != ".." && !p.empty())
-                curr.push(p);
-
-            begin = i+1;
+    while (begin <= path.size()) {
+        auto end = path.find('/', begin);
+        if (end == std::string_view::npos)
+            end = path.size();
+
+        auto p = path.substr(begin, end-begin);
+        if (p == "..") {
+            // drop the last component written, there is nothing above the root
+            while (size > 0 && out[size-1] != '/')
+                --size;
+            if (size > 0)
+                --size;
+        }
+        else if (p != "." && !p.empty()) {
+            // never ahead of the input, so out may be path itself
+            if (size > 0)
+                out[size++] = '/';
+            std::memmove(out + size, p.data(), p.size());
+            size += p.size();
         }
-    }
 
-    std::string res = "";
-    std::string sep = "";
-    while (!curr.empty()) {
-        res = curr.top() + sep + res;
-        sep = "/";
-        curr.pop();
+        begin = end+1;
     }
 
+    return size;
+}
+
+
+std::string normalizePath(const std::string &path) {
+    std::string res(path);
+    res.resize(normalizePath(res, &res[0]));
     return res;
 }
 
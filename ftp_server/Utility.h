@@ -2,28 +2,100 @@
 #define UTILITY_H
 
 
+#include <unistd.h>
+#include <array>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <limits>
 #include <iostream>
 
 
+class FileDescriptor {
+public:
+    FileDescriptor(int fd = -1)
+        : _fd{fd}
+    {}
+
+    FileDescriptor(const FileDescriptor &) = delete;
+
+    FileDescriptor(FileDescriptor &&other) noexcept
+        : _fd{other.release()}
+    {}
+
+    FileDescriptor &operator=(const FileDescriptor &) = delete;
+
+    FileDescriptor &operator=(FileDescriptor &&other) noexcept {
+        if (&other != this)
+            reset(other.release());
+
+        return *this;
+    }
+
+    ~FileDescriptor() noexcept {
+        reset();
+    }
+
+    int get() const { return _fd; }
+
+    bool isValid() const { return _fd != -1; }
+
+    int release() {
+        int fd = _fd;
+        _fd = -1;
+        return fd;
+    }
+
+    void reset(int fd = -1) {
+        if (_fd != -1)
+            close(_fd);
+
+        _fd = fd;
+    }
+
+private:
+    int _fd;
+};
+
+
 bool isRegularFile(const std::string &file);
 
 
 bool isDiretory(const std::string &directory);
 
 
+// collapses ".", ".." and repeated slashes of path in one pass and writes the
+// result to out, with no leading or trailing slash. out needs path.size() bytes
+// and may be path.data() itself. Returns the size written
+std::size_t normalizePath(std::string_view path, char *out);
+
+
 std::string normalizePath(const std::string &path);
 
 
 void printFileStat(std::ostream &stream, const struct stat &fstat);
 
 
-std::ostream &logDateTime(std::ostream &stream);
+std::vector<std::string> splitString(const std::string &str, const std::string &token);
 
 
-std::vector<std::string> splitString(const std::string &str, const std::string &token);
+// splits str at every token without copying, filling at most N fields. Returns
+// the number of fields str has, which may be more than N
+template<std::size_t N>
+std::size_t splitView(std::string_view str, char token, std::array<std::string_view, N> &fields) {
+    std::size_t count = 0;
+    while (true) {
+        auto pos = str.find(token);
+        if (count < N)
+            fields[count] = str.substr(0, pos);
+
+        ++count;
+        if (pos == std::string_view::npos)
+            return count;
+
+        str.remove_prefix(pos + 1);
+    }
+}
 
 
 template<typename Iter>
@@ -40,13 +112,13 @@ std::string joinString(Iter begin, Iter end, const std::string &token) {
 
 
 template<typename UnsigedInt>
-int toUnsignedInt(const std::string &str, UnsigedInt &res) {
+int toUnsignedInt(std::string_view str, UnsigedInt &res) {
     uint64_t num = 0;
     for (auto c = str.begin(); c != str.end(); ++c) {
 
         if (*c >= '0' && *c <= '9') {
             UnsigedInt digit = *c - '0';
-            if (num <= std::numeric_limits<UnsigedInt>::max() - digit)
+            if (num <= (std::numeric_limits<UnsigedInt>::max() - digit) / 10)
                 num = num * 10 + digit;
             else
                 return 1;
@@ -0,0 +1,80 @@
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "WorkerPool.h"
+
+
+/************************************************************
+ * WorkerPool class definition
+ ************************************************************/
+struct WorkerPool::Impl {
+    void run() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [this]() { return stop || !tasks.empty(); });
+                if (tasks.empty())
+                    return;
+
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+
+            task();
+        }
+    }
+
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<std::function<void()>> tasks;
+    std::vector<std::thread> threads;
+    bool stop;
+};
+
+
+WorkerPool::WorkerPool(unsigned threads) {
+    _impl = std::make_unique<Impl>();
+    _impl->stop = false;
+    for (unsigned i = 0; i < std::max(1u, threads); ++i)
+        _impl->threads.emplace_back(&Impl::run, _impl.get());
+}
+
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> guard(_impl->mutex);
+        _impl->stop = true;
+    }
+
+    _impl->ready.notify_all();
+    for (auto &thread : _impl->threads)
+        thread.join();
+}
+
+
+void WorkerPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> guard(_impl->mutex);
+        _impl->tasks.push_back(std::move(task));
+    }
+
+    _impl->ready.notify_one();
+}
+
+
+void WorkerPool::grow(unsigned threads) {
+    std::lock_guard<std::mutex> guard(_impl->mutex);
+    while (_impl->threads.size() < threads)
+        _impl->threads.emplace_back(&Impl::run, _impl.get());
+}
+
+
+unsigned WorkerPool::threads() const {
+    std::lock_guard<std::mutex> guard(_impl->mutex);
+    return static_cast<unsigned>(_impl->threads.size());
+}
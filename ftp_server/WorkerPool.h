@@ -0,0 +1,33 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <functional>
+#include <memory>
+
+
+// Set of threads running submitted tasks in FIFO order. It only grows when asked to.
+class WorkerPool {
+public:
+    WorkerPool(unsigned threads);
+
+    WorkerPool(const WorkerPool &) = delete;
+
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    // waits for queued tasks to finish
+    ~WorkerPool();
+
+    void submit(std::function<void()> task);
+
+    // adds threads until there are at least that many
+    void grow(unsigned threads);
+
+    unsigned threads() const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+
+#endif // WORKERPOOL_H
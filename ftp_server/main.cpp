@@ -1,17 +1,81 @@
 #include <iostream>
+#include <map>
 #include <string>
-#include <fstream>
 #include <thread>
-#include <iostream>
-#include "FtpSession.h"
+#include "FtpServer.h"
 #include "Utility.h"
 
 
 void displayUsage() {
-    std::cout << "Usage: ftp_client_exe [IP addr or hostname] [log file] [port number]\n";
-    std::cout << "[IP addr or hostname]: REQUIRED. The IP address or hostname of ftp server to connect to\n";
-    std::cout << "[log file           ]: REQUIRED. The log file to log the client actions\n";
-    std::cout << "[port number        ]: OPTIONAL. The port number used to connect to ftp server. Default is port 21\n";
+    std::cout << "Usage: ftp_server_exe [log file] [port number] [options]\n";
+    std::cout << "[log file           ]: REQUIRED. The log file to log the server actions\n";
+    std::cout << "[port number        ]: REQUIRED. The port number to accept control connections on\n";
+    std::cout << "[options            ]: OPTIONAL. Any of the following\n";
+    std::cout << "    --passive-ports MIN-MAX: port range used by PASV and EPSV. Default is 1024-65535\n";
+    std::cout << "    --max-sessions N       : connections served at once, others get 421. Default is 1000\n";
+    std::cout << "    --event-loops N        : threads serving control connections. Default is one per core\n";
+    std::cout << "    --reuse-port on|off    : one SO_REUSEPORT listener per event loop, accepting on its own. Default is off\n";
+    std::cout << "    --workers N            : threads running data transfers. Default is 4 per core,\n"
+                 "                             one per session once any rate limit applies\n";
+    std::cout << "    --buffer-size BYTES    : size of the two buffers each transfer uses. Default is 262144\n";
+    std::cout << "    --list-cache BYTES     : memory for cached directory listings, 0 disables it. Default is 16777216\n";
+    std::cout << "    --io-uring on|off      : move file data with io_uring when the kernel supports it. Default is off\n";
+    std::cout << "    --durability MODE      : none, fdatasync, direct or batch, how uploads reach the disk. Default is none\n";
+    std::cout << "    --sync-batch-ms N      : how long a batched sync waits for other uploads. Default is 5\n";
+    std::cout << "    --rate-limit BYTES     : bytes per second for all transfers together, 0 is unlimited. Default is 0\n";
+    std::cout << "    --session-rate-limit BYTES: bytes per second for each session, 0 is unlimited. Default is 0\n";
+}
+
+
+bool parseOption(const std::string &option, const std::string &value, FtpServerConfig &config) {
+    if (option == "--passive-ports") {
+        auto range = splitString(value, "-");
+        return range.size() == 2 &&
+               toUnsignedInt<uint16_t>(range[0], config.passivePortMin) == 0 &&
+               toUnsignedInt<uint16_t>(range[1], config.passivePortMax) == 0 &&
+               config.passivePortMin > 0 &&
+               config.passivePortMin <= config.passivePortMax;
+    }
+
+    else if (option == "--max-sessions")
+        return toUnsignedInt<std::size_t>(value, config.maxSessions) == 0;
+    else if (option == "--event-loops")
+        return toUnsignedInt<unsigned>(value, config.eventLoops) == 0;
+    else if (option == "--reuse-port" && (value == "on" || value == "off")) {
+        config.reusePort = value == "on";
+        return true;
+    }
+    else if (option == "--workers")
+        return toUnsignedInt<unsigned>(value, config.workerThreads) == 0;
+    else if (option == "--buffer-size")
+        return toUnsignedInt<std::size_t>(value, config.transferBufferSize) == 0 &&
+               config.transferBufferSize >= 4096 &&
+               config.transferBufferSize <= 64 * 1024 * 1024;
+    else if (option == "--list-cache")
+        return toUnsignedInt<std::size_t>(value, config.listingCacheSize) == 0;
+    else if (option == "--io-uring" && (value == "on" || value == "off")) {
+        config.ioUring = value == "on";
+        return true;
+    }
+    else if (option == "--durability") {
+        static const std::map<std::string, Durability> modes = {
+            { "none", NO_SYNC }, { "fdatasync", FDATASYNC }, { "direct", DIRECT_IO }, { "batch", BATCHED_SYNC }
+        };
+
+        auto mode = modes.find(value);
+        if (mode != modes.end())
+            config.durability = mode->second;
+
+        return mode != modes.end();
+    }
+    else if (option == "--sync-batch-ms")
+        return toUnsignedInt<unsigned>(value, config.syncBatchMs) == 0;
+    else if (option == "--rate-limit")
+        return toUnsignedInt<uint64_t>(value, config.globalRateLimit) == 0;
+    else if (option == "--session-rate-limit")
+        return toUnsignedInt<uint64_t>(value, config.sessionRateLimit) == 0;
+
+    return false;
 }
 
 
@@ -19,7 +83,8 @@ int main(int argc, const char **argv) {
     // parsing command line
     std::string logFile, portStr;
     uint16_t port;
-    if (argc == 3) {
+    FtpServerConfig config;
+    if (argc >= 3 && argc % 2 == 1) {
         logFile  = argv[1];
         portStr = argv[2] ;
         int res = toUnsignedInt<uint16_t>(portStr, port);
@@ -31,21 +96,26 @@ int main(int argc, const char **argv) {
             std::cout << "Port number overflow.\n";
             exit(0);
         }
+
+        for (int i = 3; i < argc; i += 2) {
+            if (!parseOption(argv[i], argv[i+1], config)) {
+                std::cout << "Invalid option " << argv[i] << " " << argv[i+1] << "\n";
+                displayUsage();
+                exit(0);
+            }
+        }
     }
     else {
         displayUsage();
         exit(0);
     }
 
-    // open log file
-    std::ofstream logger(logFile, std::ios::app);
-    if (!logger) {
-        std::cout << "Cannot open file " << logFile << "\n";
-        exit(0);
-    }
-
     // spin server
-    runFtpServer(port, "accounts", IPv6);
+    config.logFile      = logFile;
+    config.port         = port;
+    config.protocol     = IPv6;
+    config.accountsFile = "accounts";
+    runFtpServer(config);
 
     exit(0);
 }
@@ -0,0 +1,30 @@
+#include <string>
+#include "catch.hpp"
+#include "FtpSession.h"
+
+
+TEST_CASE("test command dispatch", "FtpCommand") {
+    // every command is found under its own name, in any case
+    for (int id = 0; id < FtpCommand::count(); ++id) {
+        const FtpCommand &cmd = FtpCommand::byId(id);
+        std::string lower = cmd.name;
+        for (auto &c : lower)
+            c = static_cast<char>(c | 0x20);
+
+        REQUIRE(FtpCommand::find(cmd.name) == &cmd);
+        REQUIRE(FtpCommand::find(lower) == &cmd);
+        REQUIRE(cmd.id() == id);
+    }
+
+    REQUIRE(FtpCommand::find("Retr")->transfersData());
+    REQUIRE(FtpCommand::find("ABOR")->runsDuringTransfer());
+    REQUIRE(!FtpCommand::find("USER")->needsLogin());
+
+    // unknown verbs, verbs with a known prefix and bytes that fold onto letters
+    REQUIRE(FtpCommand::find("HELP") == nullptr);
+    REQUIRE(FtpCommand::find("RE") == nullptr);
+    REQUIRE(FtpCommand::find("RETRX") == nullptr);
+    REQUIRE(FtpCommand::find("") == nullptr);
+    REQUIRE(FtpCommand::find(std::string("PW\x04", 3)) == nullptr);
+    REQUIRE(FtpCommand::find("PW{") == nullptr);
+}
@@ -0,0 +1,100 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <stdlib.h>
+#include <unistd.h>
+#include "catch.hpp"
+#include "FtpServer.h"
+#include "FtpSession.h"
+#include "Socket.h"
+
+
+// a client on one end of a real control connection, the session on the other
+struct SessionFixture {
+    SessionFixture(FtpServer &server) {
+        Socket listenSock = Socket::listen(0, 1, IPv4);
+        client = Socket::connect("127.0.0.1", localPort(listenSock));
+        Socket ctrlSock = Socket::accept(listenSock);
+        ctrlSock.setNonBlocking(true);
+        pi = std::make_unique<FtpServerPI>(std::move(ctrlSock), server);
+        pi->start();
+    }
+
+    static uint16_t localPort(const Socket &sock) {
+        sockaddr_in addr = {};
+        socklen_t len = sizeof(addr);
+        getsockname(sock.nativeHandle(), reinterpret_cast<sockaddr *>(&addr), &len);
+        return ntohs(addr.sin_port);
+    }
+
+    std::string reply() {
+        char line[512];
+        return std::string(line, client.readline(line, sizeof(line)));
+    }
+
+    std::string command(const std::string &line) {
+        std::string input = line + "\r\n";
+        client.write(reinterpret_cast<const Byte *>(input.data()), input.size());
+        pi->onReadable();
+        return hasPendingTransfer() ? "" : reply();
+    }
+
+    bool hasPendingTransfer() const {
+        return pi->hasPendingTransfer();
+    }
+
+    Socket client;
+    std::unique_ptr<FtpServerPI> pi;
+};
+
+
+static std::string readFile(const std::string &path) {
+    std::ifstream file(path);
+    std::stringstream content;
+    content << file.rdbuf();
+    return content.str();
+}
+
+
+TEST_CASE("test resumed upload", "FtpSession") {
+    char dir[] = "/tmp/test_ftp_server.XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+    std::string home = dir;
+    std::ofstream(home + "/accounts") << "alice secret " << home.substr(1) << "\n";
+    std::ofstream(home + "/file") << "hello world";
+
+    FtpServerConfig config;
+    config.accountsFile = home + "/accounts";
+    FtpServer server(config);
+    SessionFixture session(server);
+    REQUIRE(session.reply().compare(0, 3, "220") == 0);
+    REQUIRE(session.command("USER alice").compare(0, 3, "331") == 0);
+    REQUIRE(session.command("PASS secret").compare(0, 3, "230") == 0);
+    REQUIRE(session.command("TYPE I").compare(0, 3, "200") == 0);
+
+    std::string epsv = session.command("EPSV 1");
+    REQUIRE(epsv.compare(0, 3, "229") == 0);
+    auto port = static_cast<uint16_t>(std::stoi(epsv.substr(epsv.find("|||") + 3)));
+    REQUIRE(session.command("REST 5").compare(0, 3, "350") == 0);
+
+    // the upload goes into the existing file from the restart point
+    session.command("STOR file");
+    REQUIRE(session.hasPendingTransfer());
+    {
+        Socket data = Socket::connect("127.0.0.1", port);
+        data.write(reinterpret_cast<const Byte *>(" there"), 6);
+    }
+    session.pi->runPendingTransfer();
+    session.pi->finishPendingTransfer();
+    REQUIRE(session.reply().compare(0, 3, "150") == 0);
+    REQUIRE(session.reply().compare(0, 3, "226") == 0);
+    REQUIRE(readFile(home + "/file") == "hello there");
+
+    unlink((home + "/file").c_str());
+    unlink((home + "/accounts").c_str());
+    rmdir(dir);
+}
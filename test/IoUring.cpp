@@ -0,0 +1,57 @@
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+#include "catch.hpp"
+#include "IoUring.h"
+
+
+TEST_CASE("test io_uring receive with short writes", "IoUring") {
+    if (!ioUringSupported())
+        return;
+
+    std::string sent;
+    for (int i = 0; sent.size() < 1024 * 1024; ++i)
+        sent += std::to_string(i) + ",";
+
+    int sock[2], pipefd[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sock) == 0);
+    REQUIRE(pipe(pipefd) == 0);
+
+    // a pipe smaller than the transfer buffer takes each write only in part
+    fcntl(pipefd[1], F_SETPIPE_SZ, 4096);
+
+    std::thread sender([&sent, &sock]() {
+        for (std::size_t pos = 0; pos < sent.size(); ) {
+            auto n = write(sock[1], sent.data() + pos, sent.size() - pos);
+            if (n <= 0)
+                break;
+
+            pos += static_cast<std::size_t>(n);
+        }
+
+        close(sock[1]);
+    });
+
+    std::string written;
+    std::thread drainer([&written, &pipefd]() {
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(pipefd[0], buf, sizeof(buf))) > 0)
+            written.append(buf, static_cast<std::size_t>(n));
+    });
+
+    std::size_t received = 0;
+    std::size_t total = ioUringRecvFile(sock[0], pipefd[1], 0, 64 * 1024,
+                                        [&received](std::size_t n) { received += n; });
+    close(pipefd[1]);
+    sender.join();
+    drainer.join();
+    close(sock[0]);
+    close(pipefd[0]);
+
+    REQUIRE(received == sent.size());
+    REQUIRE(total == sent.size());
+    REQUIRE(written == sent);
+}
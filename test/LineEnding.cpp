@@ -0,0 +1,83 @@
+#include <cstring>
+#include <string>
+#include <vector>
+#include "catch.hpp"
+#include "LineEnding.h"
+
+
+static std::string toCrlf(LfToCrlf &converter, const std::string &in) {
+    std::vector<char> out(2 * in.size() + 1);
+    return std::string(out.data(), converter.convert(in.data(), in.size(), out.data()));
+}
+
+
+TEST_CASE("test LF to CRLF", "LineEnding") {
+    LfToCrlf converter;
+    REQUIRE(toCrlf(converter, "") == "");
+    REQUIRE(toCrlf(converter, "line1\nline2\n") == "line1\r\nline2\r\n");
+    REQUIRE(toCrlf(converter, "\n\nno end") == "\r\n\r\nno end");
+
+    // existing CRLF is kept as is
+    REQUIRE(toCrlf(converter, "a\r\nb\nc\r\n") == "a\r\nb\r\nc\r\n");
+
+    // long enough to go through the vector loops, with lines crossing blocks
+    std::string in, expected;
+    for (int i = 0; i < 100; ++i) {
+        in += std::string(static_cast<std::size_t>(i), 'x') + (i % 3 == 0 ? "\r\n" : "\n");
+        expected += std::string(static_cast<std::size_t>(i), 'x') + "\r\n";
+    }
+    REQUIRE(toCrlf(converter, in) == expected);
+}
+
+
+TEST_CASE("test LF to CRLF across blocks", "LineEnding") {
+    LfToCrlf converter;
+    REQUIRE(toCrlf(converter, "a\r") == "a\r");
+    REQUIRE(toCrlf(converter, "\nb\n") == "\nb\r\n");
+    REQUIRE(toCrlf(converter, "\n") == "\r\n");
+}
+
+
+static std::string toLf(CrlfToLf &converter, const std::string &in) {
+    std::vector<char> out(in.size() + 1);
+    return std::string(out.data(), converter.convert(in.data(), in.size(), out.data()));
+}
+
+
+TEST_CASE("test CRLF to LF", "LineEnding") {
+    CrlfToLf converter;
+    REQUIRE(toLf(converter, "line1\r\nline2\r\n") == "line1\nline2\n");
+    REQUIRE(toLf(converter, "a\rb\n\r\r\n") == "a\rb\n\r\n");
+
+    std::string in, expected;
+    for (int i = 0; i < 100; ++i) {
+        in += std::string(static_cast<std::size_t>(i), 'x') + (i % 3 == 0 ? "\n" : "\r\n");
+        expected += std::string(static_cast<std::size_t>(i), 'x') + "\n";
+    }
+    REQUIRE(toLf(converter, in) == expected);
+
+    // converting in place, one byte behind the input
+    std::vector<char> buf(in.begin(), in.end());
+    buf.insert(buf.begin(), ' ');
+    REQUIRE(std::string(buf.data(), converter.convert(buf.data() + 1, in.size(), buf.data())) == expected);
+}
+
+
+TEST_CASE("test CRLF to LF across blocks", "LineEnding") {
+    CrlfToLf converter;
+    char out[1];
+    REQUIRE(toLf(converter, "a\r") == "a");
+    REQUIRE(toLf(converter, "\nb\r") == "\nb");
+    REQUIRE(toLf(converter, "c\r") == "\rc");
+    REQUIRE(converter.finish(out) == 1);
+    REQUIRE(out[0] == '\r');
+    REQUIRE(converter.finish(out) == 0);
+
+    // in place, the CR held back from one block goes in the byte before the next
+    char buf[] = " x\r";
+    REQUIRE(converter.convert(buf + 1, 2, buf) == 1);
+    REQUIRE(buf[0] == 'x');
+    std::strcpy(buf, " y\n");
+    REQUIRE(converter.convert(buf + 1, 2, buf) == 3);
+    REQUIRE(std::string(buf, 3) == "\ry\n");
+}
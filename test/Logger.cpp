@@ -0,0 +1,55 @@
+#include <unistd.h>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "catch.hpp"
+#include "Logger.h"
+
+
+TEST_CASE("test logger", "Logger") {
+    char path[] = "/tmp/test_ftp_server_logXXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd != -1);
+    close(fd);
+
+    {
+        Logger logger(path);
+        REQUIRE(logger.isOpen());
+
+        // producers race for slots, none of their records is lost or torn
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&logger, t]() {
+                for (int i = 0; i < 1000; ++i)
+                    logger.log(Logger::COMMAND, t, "NOOP", 0, i);
+            });
+        }
+
+        for (auto &thread : threads)
+            thread.join();
+
+        logger.flush();
+        REQUIRE(logger.dropped() == 0);
+        logger.log(Logger::LOGIN, 7, std::string(200, 'a'));
+    }
+
+    std::ifstream file(path);
+    std::string line, last;
+    int commands = 0;
+    while (std::getline(file, line)) {
+        if (line.find("NOOP (") != std::string::npos)
+            ++commands;
+
+        last = line;
+    }
+
+    REQUIRE(commands == 4000);
+    REQUIRE(last.find("[7] login " + std::string(Logger::TEXT_MAX, 'a')) != std::string::npos);
+    REQUIRE(last.size() < 140);
+    unlink(path);
+
+    Logger discard("");
+    REQUIRE(!discard.isOpen());
+    discard.log(Logger::CONNECT, discard.nextSessionId(), "127.0.0.1");
+}
@@ -0,0 +1,43 @@
+#include "catch.hpp"
+#include "Metrics.h"
+
+
+TEST_CASE("test metrics", "Metrics") {
+    Metrics metrics;
+    int id = metrics.commandId("RETR");
+    REQUIRE(id >= 0);
+    REQUIRE(metrics.commandId("RETR") == id);
+    REQUIRE(metrics.commandId("STOR") != id);
+
+    // 1us .. 1000us, the percentiles are off by at most an eighth
+    for (int us = 1; us <= 1000; ++us)
+        metrics.recordCommand(id, std::chrono::microseconds(us));
+
+    auto p50 = metrics.commandPercentile(id, 50).count();
+    REQUIRE(p50 >= 500);
+    REQUIRE(p50 <= 500 * 9 / 8 + 1);
+    auto p99 = metrics.commandPercentile(id, 99).count();
+    REQUIRE(p99 >= 990);
+    REQUIRE(p99 <= 990 * 9 / 8 + 1);
+
+    // unknown ids are dropped
+    metrics.recordCommand(-1, std::chrono::microseconds(1));
+}
+
+
+TEST_CASE("test metrics of two servers on one thread", "Metrics") {
+    Metrics first, second;
+    int id = first.commandId("RETR");
+    REQUIRE(second.commandId("RETR") == id);
+
+    // switching between them keeps what each recorded
+    for (int i = 0; i < 10; ++i) {
+        first.recordCommand(id, std::chrono::microseconds(1));
+        second.recordCommand(id, std::chrono::microseconds(1000));
+    }
+
+    REQUIRE(first.commandPercentile(id, 100).count() == 1);
+    REQUIRE(second.commandPercentile(id, 0).count() >= 1000);
+    REQUIRE(first.report().front().find("count=10 ") != std::string::npos);
+    REQUIRE(second.report().front().find("count=10 ") != std::string::npos);
+}
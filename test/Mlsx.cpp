@@ -0,0 +1,63 @@
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include "catch.hpp"
+#include "Mlsx.h"
+#include "Utility.h"
+
+
+TEST_CASE("test format facts", "Mlsx") {
+    struct stat fstat;
+    std::memset(&fstat, 0, sizeof(fstat));
+    fstat.st_mode  = S_IFREG | S_IRUSR | S_IWUSR;
+    fstat.st_size  = 1234;
+    fstat.st_mtime = 1000000000;
+
+    char buf[256];
+    std::size_t len = formatFacts(buf, sizeof(buf), fstat, "a file", 6);
+    REQUIRE(std::string(buf, len) == "type=file;size=1234;modify=20010909014640;perm=rw; a file\r\n");
+
+    fstat.st_mode = S_IFDIR | S_IRUSR | S_IXUSR;
+    len = formatFacts(buf, sizeof(buf), fstat, "dir", 3);
+    REQUIRE(std::string(buf, len) == "type=dir;size=1234;modify=20010909014640;perm=el; dir\r\n");
+
+    // does not fit
+    REQUIRE(formatFacts(buf, 20, fstat, "dir", 3) == 0);
+}
+
+
+TEST_CASE("test list directory facts", "Mlsx") {
+    char dirTemplate[] = "/tmp/mlsxXXXXXX";
+    std::string dir = mkdtemp(dirTemplate);
+    std::ofstream(dir + "/one") << "1";
+    std::ofstream(dir + "/two") << "22";
+    mkdir((dir + "/three").c_str(), 0755);
+
+    FileDescriptor dirfd(open(dir.c_str(), O_RDONLY | O_DIRECTORY));
+    REQUIRE(dirfd.isValid());
+
+    // small buffer so the listing is flushed more than once
+    char buf[64];
+    std::string listing;
+    int flushes = 0;
+    REQUIRE(listDirectoryFacts(dirfd.get(), buf, sizeof(buf), [&](const char *data, std::size_t size) {
+        listing.append(data, size);
+        ++flushes;
+    }));
+
+    REQUIRE(flushes == 3);
+    REQUIRE(listing.find("type=file;size=1;") != std::string::npos);
+    REQUIRE(listing.find("type=file;size=2;") != std::string::npos);
+    REQUIRE(listing.find("type=dir;") != std::string::npos);
+    REQUIRE(listing.find("; one\r\n") != std::string::npos);
+    REQUIRE(listing.find("; two\r\n") != std::string::npos);
+    REQUIRE(listing.find("; three\r\n") != std::string::npos);
+
+    unlink((dir + "/one").c_str());
+    unlink((dir + "/two").c_str());
+    rmdir((dir + "/three").c_str());
+    rmdir(dir.c_str());
+}
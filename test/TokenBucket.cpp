@@ -0,0 +1,25 @@
+#include "catch.hpp"
+#include "TokenBucket.h"
+
+
+TEST_CASE("test token bucket", "TokenBucket") {
+    TokenBucket unlimited(0);
+    REQUIRE(unlimited.reserve(1 << 30).count() == 0);
+
+    // a tenth of a second goes through as a burst, what comes after it waits
+    TokenBucket bucket(1000000);
+    REQUIRE(bucket.reserve(50000).count() == 0);
+    auto wait = bucket.reserve(1000000);
+    REQUIRE(wait > std::chrono::milliseconds(900));
+    REQUIRE(wait < std::chrono::milliseconds(1000));
+
+    // later reservations queue up behind it
+    REQUIRE(bucket.reserve(1000000) > wait + std::chrono::milliseconds(900));
+
+    // a refunded reservation no longer holds back the ones after it
+    bucket.refund(1000000);
+    bucket.refund(1000000);
+    wait = bucket.reserve(1000000);
+    REQUIRE(wait > std::chrono::milliseconds(900));
+    REQUIRE(wait < std::chrono::milliseconds(1000));
+}
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <stack>
 #include "catch.hpp"
 #include "Utility.h"
 
@@ -40,3 +41,116 @@ TEST_CASE("test normalize path", "Utility") {
     path = "//../../this is a dir/a/b/c/../this is an another dir/./c/";
     REQUIRE(normalizePath(path) == "this is a dir/a/b/this is an another dir/c");
 }
+
+
+TEST_CASE("test normalize path in place", "Utility") {
+    char buf[64];
+    std::string_view path = "a/./b/../../c";
+    REQUIRE(std::string_view(buf, normalizePath(path, buf)) == "c");
+
+    // the result never runs ahead of the input, so it can overwrite it
+    char inPlace[] = "//x/../this is a dir/./a//b/../c/";
+    std::size_t size = normalizePath(inPlace, inPlace);
+    REQUIRE(std::string_view(inPlace, size) == "this is a dir/a/c");
+
+    REQUIRE(normalizePath("", buf) == 0);
+    REQUIRE(normalizePath("a/..", buf) == 0);
+}
+
+
+// what normalizePath did before it worked in place, the baseline of the benchmark
+static std::string stackNormalizePath(const std::string &path) {
+    std::stack<std::string> curr;
+
+    std::size_t begin = 0;
+    for (std::size_t i = 0; i <= path.size(); ++i) {
+        if (path[i] == '/' || i == path.size()) {
+            auto p = path.substr(begin, i-begin);
+            if (p == ".." && !curr.empty())
+                curr.pop();
+            else if (p != "." && p != ".." && !p.empty())
+                curr.push(p);
+
+            begin = i+1;
+        }
+    }
+
+    std::string res = "";
+    std::string sep = "";
+    while (!curr.empty()) {
+        res = curr.top() + sep + res;
+        sep = "/";
+        curr.pop();
+    }
+
+    return res;
+}
+
+
+TEST_CASE("benchmark normalize path", "[!benchmark]") {
+    const std::vector<std::string> paths = {
+        "a/b//c",
+        "/..",
+        "////a/b//c/",
+        "//../../a/../b//c/",
+        "//../../this is a dir/../b/./c/",
+        "//../../this is a dir/a/b/c/../this is an another dir/./c/",
+    };
+
+    BENCHMARK("through a stack") {
+        std::size_t size = 0;
+        for (auto &path : paths)
+            size += stackNormalizePath(path).size();
+        return size;
+    };
+
+    BENCHMARK("to a string") {
+        std::size_t size = 0;
+        for (auto &path : paths)
+            size += normalizePath(path).size();
+        return size;
+    };
+
+    BENCHMARK("into a buffer") {
+        char buf[128];
+        std::size_t size = 0;
+        for (auto &path : paths)
+            size += normalizePath(path, buf);
+        return size;
+    };
+}
+
+
+TEST_CASE("test split view", "Utility") {
+    std::array<std::string_view, 6> fields;
+    REQUIRE(splitView("127,0,0,1,4,1", ',', fields) == 6);
+    REQUIRE(fields[0] == "127");
+    REQUIRE(fields[5] == "1");
+
+    // fields past the array are counted, not stored
+    std::array<std::string_view, 2> two;
+    REQUIRE(splitView("a|b|c", '|', two) == 3);
+    REQUIRE(two[1] == "b");
+
+    REQUIRE(splitView("", ',', two) == 1);
+    REQUIRE(two[0].empty());
+}
+
+
+TEST_CASE("test to unsigned int", "Utility") {
+    uint64_t offset = 7;
+    REQUIRE(toUnsignedInt("18446744073709551615", offset) == 0);
+    REQUIRE(offset == UINT64_MAX);
+
+    // a REST offset above UINT64_MAX is rejected rather than wrapped
+    offset = 7;
+    REQUIRE(toUnsignedInt("18446744073709551616", offset) == 1);
+    REQUIRE(toUnsignedInt("99999999999999999999", offset) == 1);
+    REQUIRE(offset == 7);
+
+    uint16_t port;
+    REQUIRE(toUnsignedInt("65535", port) == 0);
+    REQUIRE(port == 65535);
+    REQUIRE(toUnsignedInt("65536", port) == 1);
+    REQUIRE(toUnsignedInt("12a", port) == -1);
+}